@@ -35,8 +35,20 @@
 #include <vector>
 #include <cstring>
 #include <cstdio>
+#include <climits>
 #include <linux/blktrace_api.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <queue>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "tracereader.h"
+#include "checkpoint.h"
+#include "cgroups.h"
+#include "devices.h"
 
 using namespace std;
 
@@ -44,12 +56,32 @@ using namespace std;
 /* Parameters */
 bool COMMS = false; /* Include communications */
 bool ENERGY = false;
+bool LANES = false; /* Include per CPU submission / completion lanes */
+bool COUNTERS = false; /* Include queue depth and bandwidth counters */
+bool CGROUPS = false; /* Group the pids in a task per cgroup */
+unsigned long long BWWINDOW = 100000000; /* Bandwidth sliding window (ns) */
+unsigned long long RATELIMIT = 0; /* Minimum time between two events of a counter (ns) */
 
 
 unsigned int PIDDISK = 1;
 unsigned int PIDE5 = 999999+1;
 unsigned int PIDE12 = 999999+2;
-map < int, string > pid2name;
+
+/* pids, devices and names are scoped per node (input trace), node 0 keys are the plain id */
+unsigned long long nodeKey (unsigned int node, unsigned int id)
+{
+    return ((unsigned long long) node << 32) | id;
+}
+
+map < unsigned long long, string > pid2name;
+
+/*
+   Cgroup of each pid (nodeKey), taken from the bios it queues, and the
+   task of each cgroup of a node, with its names
+ */
+unordered_map < unsigned long long, unsigned long long > PID2CGROUP;
+map < pair < unsigned int, unsigned long long >, unsigned long long > CGROUP_TASKS;
+map < unsigned long long, string > cgroup2name;
 
 /* List of events captured */
 enum class EVENTS {
@@ -74,6 +106,8 @@ enum class EVENTS {
     FRONTMERGE,
     BACKMERGE,
     ENERGY,
+    FUA,
+    DISCARD,
     LAST_ELEMENT
 };
 
@@ -88,20 +122,547 @@ enum class TYPES {
     RA,
     ENERGY5,
     ENERGY12,
+    SCHEDQUEUE,
+    DRIVERQUEUE,
+    BYTESINFLY,
+    BANDWIDTH,
+    FLUSH,
+    FUA,
+    DISCARD,
+    ORDERED,
     LAST_ELEMENT
 };
 
-int numPID;
 unsigned long long lastTimeStamp;
-map < int, int > PIDS;
-map < int, int > RPIDS;
+unsigned long long prvSize; /* Bytes of the .prv written so far, to resume it */
+
+/*
+   Paraver object model, discovered while the trace is converted.
+   There is a node per input trace. Applications are fixed at startup
+   (devices, cpu lanes, energy), tasks and threads are created the first
+   time they are used:
+   - devices application: a task per device of each node, a thread per pid
+     (and the Disk). With cgroups, the pids are moved to a task per cgroup
+     of each node, and the device tasks only hold the Disk
+   - cpu lanes application: a task per node, a submission and a completion
+     thread per cpu
+   - energy application: a single task with the energy threads
+   Records are written with the cpu of their own node, they are renumbered
+   to global cpus (remapCPU) when the trace has more than one node. A
+   resumed trace keeps the numbering of the old one (keepBases) so its
+   records stay valid.
+ */
+unsigned int APPL_DEVICES = 1;
+unsigned int APPL_LANES = 0;
+unsigned int APPL_ENERGY = 0;
+
+class objectModel
+{
+private:
+    struct threadEntry {
+        unsigned long long key;
+        string name; /* Empty if the name comes from pid2name */
+    };
+    struct task {
+        unsigned long long key;
+        string name;
+        unsigned int node;
+        vector < threadEntry > threads;
+        map < unsigned long long, unsigned int > index;
+    };
+    vector < vector < task > > appls;
+    vector < map < unsigned long long, unsigned int > > taskIndex;
+    vector < unsigned int > cpuBase;
+
+public:
+    vector < string > nodeNames;
+    vector < unsigned int > numCPU;  /* Per node */
+
+    objectModel (unsigned int numAppl, const vector < string > & nodes) : appls (numAppl), taskIndex (numAppl),
+        nodeNames (nodes), numCPU (nodes.size (), 1) {}
+
+    unsigned int getTask (unsigned int appl, unsigned long long key, const string & name, unsigned int node = 0) {
+        auto I = taskIndex[appl - 1].find (key);
+        if (I != taskIndex[appl - 1].end ()) return I->second;
+
+        appls[appl - 1].push_back (task ());
+        appls[appl - 1].back ().key = key;
+        appls[appl - 1].back ().name = name;
+        appls[appl - 1].back ().node = node;
+        return taskIndex[appl - 1][key] = appls[appl - 1].size ();
+    }
+
+    unsigned int getThread (unsigned int appl, unsigned int tsk, unsigned long long key, const string & name = "") {
+        task & T = appls[appl - 1][tsk - 1];
+        auto I = T.index.find (key);
+        if (I != T.index.end ()) return I->second;
+
+        T.threads.push_back (threadEntry {key, name});
+        return T.index[key] = T.threads.size ();
+    }
+
+    void useCPU (unsigned int node, unsigned int cpu) {
+        if (cpu + 1 > numCPU[node]) numCPU[node] = cpu + 1;
+    }
+
+    bool multiNode () const {
+        return nodeNames.size () > 1;
+    }
+
+    /* Header resource and application model */
+    string header () {
+        ostringstream out;
+        out << nodeNames.size () << "(";
+        for (unsigned int i = 0; i < numCPU.size (); i++) out << (i ? "," : "") << numCPU[i];
+        out << "):" << appls.size ();
+        for (auto & A : appls) {
+            out << ":" << A.size () << "(";
+            for (unsigned int i = 0; i < A.size (); i++)
+                out << (i ? "," : "") << A[i].threads.size () << ":" << A[i].node + 1;
+            out << ")";
+        }
+        return out.str ();
+    }
+
+    /*
+       Numbers the cpus as the resumed trace did (base), the cpus of a node
+       it did not use stay idle. False if a node has now more cpus than the
+       old numbering leaves it, the old records have to be renumbered then.
+     */
+    bool keepBases (const vector < unsigned int > & base) {
+        for (unsigned int n = 0; n + 1 < base.size (); n++)
+            if (numCPU[n] > base[n + 1] - base[n]) return false;
+
+        for (unsigned int n = 0; n + 1 < base.size (); n++) numCPU[n] = base[n + 1] - base[n];
+        cpuBase = base;
+        return true;
+    }
+
+    /* First global cpu of each node */
+    const vector < unsigned int > & bases () {
+        if (cpuBase.empty ()) {
+            unsigned int base = 0;
+            for (auto n : numCPU) {
+                cpuBase.push_back (base);
+                base += n;
+            }
+        }
+        return cpuBase;
+    }
+
+    /*
+       Renumbers the node local cpus of a state, event or communication record,
+       or the global cpus of a record written with other bases (oldBase)
+     */
+    string remapCPU (const string & line, const vector < unsigned int > * oldBase = NULL) {
+        bases ();
+
+        vector < string > fields;
+        istringstream in (line);
+        string field;
+        while (getline (in, field, ':')) fields.push_back (field);
+        if (fields.size () < 5) return line;
+
+        auto remap = [this, &fields, oldBase] (int c) {
+            unsigned int appl = stoul (fields[c + 1]), tsk = stoul (fields[c + 2]);
+            unsigned int node = appls[appl - 1][tsk - 1].node;
+            fields[c] = to_string (stoul (fields[c]) + cpuBase[node] - (oldBase ? (*oldBase)[node] : 0));
+        };
+        remap (1);
+        if (fields[0] == "3" and fields.size () > 10) remap (7);
+
+        string out = fields[0];
+        for (unsigned int i = 1; i < fields.size (); i++) out += ":" + fields[i];
+        return out;
+    }
+
+    void save (ostream & out) {
+        out << nodeNames.size () << "\n";
+        for (unsigned int n = 0; n < nodeNames.size (); n++) {
+            saveString (out, nodeNames[n]);
+            out << numCPU[n] << " " << bases ()[n] << "\n";
+        }
+
+        out << appls.size () << "\n";
+        for (auto & A : appls) {
+            out << A.size () << "\n";
+            for (auto & T : A) {
+                out << T.key << " " << T.node << " ";
+                saveString (out, T.name);
+                out << T.threads.size () << "\n";
+                for (auto & t : T.threads) {
+                    out << t.key << " ";
+                    saveString (out, t.name);
+                    out << "\n";
+                }
+            }
+        }
+    }
+
+    /* Loads a saved model, returns the cpu bases the saved trace was written with */
+    vector < unsigned int > load (istream & in) {
+        size_t n;
+        vector < unsigned int > oldBase;
+
+        in >> n;
+        if (n != nodeNames.size ()) {
+            cerr << "The checkpoint has " << n << " input files" << endl;
+            exit(-1);
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            unsigned int base;
+            loadString (in);
+            in >> numCPU[i] >> base;
+            oldBase.push_back (base);
+        }
+
+        in >> n;
+        if (n != appls.size ()) {
+            cerr << "The options do not match the ones of the checkpoint" << endl;
+            exit(-1);
+        }
+        for (unsigned int a = 0; a < n; a++) {
+            size_t numTasks;
+            in >> numTasks;
+            for (size_t i = 0; i < numTasks; i++) {
+                task T;
+                size_t numThreads;
+                in >> T.key >> T.node;
+                T.name = loadString (in);
+                in >> numThreads;
+                for (size_t j = 0; j < numThreads; j++) {
+                    threadEntry t;
+                    in >> t.key;
+                    t.name = loadString (in);
+                    T.threads.push_back (t);
+                    T.index[t.key] = T.threads.size ();
+                }
+                appls[a].push_back (T);
+                taskIndex[a][T.key] = appls[a].size ();
+            }
+        }
+        return oldBase;
+    }
+
+    void generateROWFile (const string & filename) {
+        ofstream ROW (filename + ".row");
+
+        unsigned int totalCPU = 0;
+        for (auto n : numCPU) totalCPU += n;
+
+        ROW << "LEVEL CPU SIZE " << totalCPU << endl;
+        for (unsigned int n = 0; n < numCPU.size (); n++)
+            for (unsigned int i = 0; i < numCPU[n]; i++)
+                ROW << (multiNode () ? nodeNames[n] + " " : "") << "CPU " << i << endl;
+
+        ROW << endl << "LEVEL NODE SIZE " << nodeNames.size () << endl;
+        for (auto & n : nodeNames) ROW << n << endl;
+
+        unsigned int numTasks = 0, numThreads = 0;
+        for (auto & A : appls) {
+            numTasks += A.size ();
+            for (auto & T : A) numThreads += T.threads.size ();
+        }
+
+        ROW << endl << "LEVEL TASK SIZE " << numTasks << endl;
+        for (auto & A : appls)
+            for (auto & T : A) ROW << T.name << endl;
+
+        ROW << endl << "LEVEL THREAD SIZE " << numThreads << endl;
+        for (auto & A : appls)
+            for (auto & T : A)
+                for (auto & t : T.threads) {
+                    if (not t.name.empty ()) ROW << t.name << endl;
+                    else if ((t.key & 0xffffffff) == PIDDISK) ROW << pid2name[PIDDISK] << endl;
+                    else if (pid2name.find (t.key) != pid2name.end ()) ROW << pid2name[t.key] << endl;
+                    else ROW << "PID " << (t.key & 0xffffffff) << endl;
+                }
+
+        ROW.close ();
+    }
+};
+
+objectModel * objects;
+
+string nodePrefix (unsigned int node)
+{
+    return objects->multiNode () ? objects->nodeNames[node] + " " : "";
+}
+
+/* Task of the cgroup of a pid, their keys have the top bit set so they never match a device */
+unsigned int cgroupTask (unsigned int node, unsigned int pid)
+{
+    auto C = PID2CGROUP.find (nodeKey (node, pid));
+    unsigned long long cgroup = C == PID2CGROUP.end () ? 0 : C->second;
+
+    auto I = CGROUP_TASKS.find (make_pair (node, cgroup));
+    if (I == CGROUP_TASKS.end ())
+        I = CGROUP_TASKS.insert (make_pair (make_pair (node, cgroup), (1ULL << 63) | CGROUP_TASKS.size ())).first;
+
+    return objects->getTask (APPL_DEVICES, I->second, nodePrefix (node) + "Cgroup " + cgroupName (cgroup2name, cgroup), node);
+}
+
+/* Returns the cpu:appl:task:thread part of a record, for a pid of a device */
+string object (unsigned int node, unsigned int cpu, unsigned int device, unsigned int pid)
+{
+    unsigned int task = objects->getTask (APPL_DEVICES, nodeKey (node, device), nodePrefix (node) + "Device " + devName (device), node);
+    objects->getThread (APPL_DEVICES, task, nodeKey (node, PIDDISK)); /* The Disk is always the first thread */
+    objects->useCPU (node, cpu);
+
+    if (CGROUPS and pid != PIDDISK) task = cgroupTask (node, pid);
+
+    return to_string (cpu + 1) + ":" + to_string (APPL_DEVICES) + ":" + to_string (task) + ":" +
+           to_string (objects->getThread (APPL_DEVICES, task, nodeKey (node, pid)));
+}
+
+/* Returns the cpu:appl:task:thread part of a record, for a cpu lane */
+string laneObject (unsigned int node, unsigned int cpu, bool completion)
+{
+    unsigned int task = objects->getTask (APPL_LANES, node, nodePrefix (node) + "CPU lanes", node);
+    unsigned int thread = objects->getThread (APPL_LANES, task, 2 * cpu + completion,
+                          "CPU " + to_string (cpu) + (completion ? " completion" : " submission"));
+    objects->useCPU (node, cpu);
+
+    return to_string (cpu + 1) + ":" + to_string (APPL_LANES) + ":" + to_string (task) + ":" + to_string (thread);
+}
 
 typedef pair < unsigned long long, unsigned long long >P;
 
 typedef map < unsigned int, vector< P > > INFLY_PER_PID;   // MAP with pid, offset and size of a issued operation
-unordered_map <  unsigned int , INFLY_PER_PID> INFLY_PER_EVENT;
+typedef unordered_map <  unsigned int , INFLY_PER_PID> INFLY_PER_EVENT;
+unordered_map < unsigned long long, INFLY_PER_EVENT > INFLY_PER_DEVICE;
+
+unordered_map < unsigned long long, vector < blk_io_trace > > WANT_SEND;   // We store Insert events...
+
+/*
+   Running counters of a device, updated in O(1) per event:
+   requests inserted in the scheduler and not yet dispatched, requests
+   dispatched to the driver and not yet completed, bytes in the driver, and
+   bandwidth of the completions over a sliding window.
+   The window is a ring of slots, so its cost does not depend on the rate.
+   Requests that bypass the scheduler or completions of merged requests may
+   drive a counter below zero, so counters are clamped at 0.
+ */
+class deviceCounters
+{
+private:
+    static const int SLOTS = 16;
+    static const int NUMCOUNTERS = 4;
+
+    unsigned long long slot[SLOTS];
+    unsigned long long head;    /* Slot index (time / slot width) of the newest slot */
+    unsigned long long windowBytes;
+
+    unsigned long long value[NUMCOUNTERS];
+    unsigned long long emitted[NUMCOUNTERS];
+    unsigned long long lastEmit[NUMCOUNTERS];
+    bool pending[NUMCOUNTERS];
+
+    void slide (unsigned long long time) {
+        unsigned long long idx = time / slotWidth ();
+        if (idx <= head) return;
+        if (idx - head >= SLOTS) {
+            memset (slot, 0, sizeof (slot));
+            windowBytes = 0;
+        }
+        else while (head < idx) {
+            head++;
+            windowBytes -= slot[head % SLOTS];
+            slot[head % SLOTS] = 0;
+        }
+        head = idx;
+    }
+
+    static unsigned long long dec (unsigned long long v, unsigned long long d) {
+        return v > d ? v - d : 0;
+    }
+
+    /* KB/s */
+    unsigned long long bandwidth () const {
+        return windowBytes * 1000000000ULL / BWWINDOW / 1024;
+    }
+
+    /* Writes counter i if it changed, unless it was written less than RATELIMIT ns ago */
+    void write (ofstream & PAR, const string & obj, int i, unsigned long long time, bool force) {
+        static const TYPES types[NUMCOUNTERS] = { TYPES::SCHEDQUEUE, TYPES::DRIVERQUEUE, TYPES::BYTESINFLY, TYPES::BANDWIDTH };
+
+        if (value[i] == emitted[i]) {
+            pending[i] = false;
+            return;
+        }
+        if (not force and RATELIMIT and lastEmit[i] and time < lastEmit[i] + RATELIMIT) {
+            pending[i] = true;
+            return;
+        }
+
+        PAR << "2:" << obj << ":" << time << ":" << static_cast<unsigned int> (types[i]) << ":" << value[i] << endl;
+        emitted[i] = value[i];
+        lastEmit[i] = time;
+        pending[i] = false;
+    }
+
+public:
+    enum { SCHED = 0, DRIVER, BYTES, BW };
+
+    static unsigned long long slotWidth () {
+        return max (BWWINDOW / SLOTS, 1ULL);
+    }
+
+    deviceCounters () : head (0), windowBytes (0) {
+        memset (slot, 0, sizeof (slot));
+        memset (value, 0, sizeof (value));
+        memset (emitted, 0, sizeof (emitted));
+        memset (lastEmit, 0, sizeof (lastEmit));
+        memset (pending, 0, sizeof (pending));
+    }
+
+    void update (const blk_io_trace & trace) {
+        slide (trace.time);
+
+        switch (trace.action & 0xffff) {
+        case __BLK_TA_INSERT:
+            value[SCHED]++;
+            break;
+
+        case __BLK_TA_ISSUE:
+            value[SCHED] = dec (value[SCHED], 1);
+            value[DRIVER]++;
+            value[BYTES] += trace.bytes;
+            break;
+
+        case __BLK_TA_COMPLETE:
+            value[DRIVER] = dec (value[DRIVER], 1);
+            value[BYTES] = dec (value[BYTES], trace.bytes);
+            slot[head % SLOTS] += trace.bytes;
+            windowBytes += trace.bytes;
+            break;
+        }
+
+        value[BW] = bandwidth ();
+    }
+
+    /* Writes the counters that changed, unless they were written less than RATELIMIT ns ago */
+    void emit (ofstream & PAR, const string & obj, unsigned long long time, bool force = false) {
+        for (int i = 0; i < NUMCOUNTERS; i++) write (PAR, obj, i, time, force);
+    }
+
+    /*
+       Next time the counters change without new records, ULLONG_MAX if they
+       do not: completions leave the window at slot boundaries, and values
+       held back by the rate limit are due RATELIMIT ns after the last write.
+     */
+    unsigned long long nextChange () const {
+        unsigned long long next = windowBytes ? (head + 1) * slotWidth () : ULLONG_MAX;
+        for (int i = 0; i < NUMCOUNTERS; i++)
+            if (pending[i]) next = min (next, lastEmit[i] + RATELIMIT);
+        return next;
+    }
+
+    /*
+       Writes the changes of time, a nextChange (). An idle device so drops
+       to 0 bandwidth one window after its last completion, the drop to 0 is
+       always written, whatever the rate limit.
+     */
+    void advance (ofstream & PAR, const string & obj, unsigned long long time) {
+        if (windowBytes and (head + 1) * slotWidth () == time) {
+            head++;
+            windowBytes -= slot[head % SLOTS];
+            slot[head % SLOTS] = 0;
+            value[BW] = bandwidth ();
+            write (PAR, obj, BW, time, value[BW] == 0);
+        }
+        for (int i = 0; i < NUMCOUNTERS; i++)
+            if (pending[i] and lastEmit[i] + RATELIMIT <= time) write (PAR, obj, i, time, false);
+    }
+
+    bool hasPending () const {
+        for (int i = 0; i < NUMCOUNTERS; i++)
+            if (pending[i]) return true;
+        return false;
+    }
 
-unordered_map < unsigned int, vector < blk_io_trace > > WANT_SEND;   // We store Insert events...
+    void save (ostream & out) const {
+        out << head << " " << windowBytes;
+        for (int i = 0; i < SLOTS; i++) out << " " << slot[i];
+        for (int i = 0; i < NUMCOUNTERS; i++)
+            out << " " << value[i] << " " << emitted[i] << " " << lastEmit[i] << " " << pending[i];
+        out << "\n";
+    }
+
+    void load (istream & in) {
+        in >> head >> windowBytes;
+        for (int i = 0; i < SLOTS; i++) in >> slot[i];
+        for (int i = 0; i < NUMCOUNTERS; i++)
+            in >> value[i] >> emitted[i] >> lastEmit[i] >> pending[i];
+    }
+};
+
+map < unsigned long long, deviceCounters > COUNTERS_PER_DEVICE;
+
+/*
+   Flush and FUA requests in the driver per device (nodeKey). Other
+   requests are ordered behind them, so the event on the Disk thread marks
+   the ordering stalls.
+ */
+unordered_map < unsigned long long, unsigned int > ORDERED_PER_DEVICE;
+
+/* Earliest nextChange () of the devices, 0 until it is known */
+unsigned long long counterDue = 0;
+
+/*
+   Writes the changes of the counters of all the devices up to time, in
+   time order, before the records of time. The bandwidth decays and the
+   held back values show up on idle devices too.
+ */
+void decayCounters (ofstream & PAR, unsigned long long time)
+{
+    while (counterDue <= time) {
+        auto next = COUNTERS_PER_DEVICE.end ();
+        counterDue = ULLONG_MAX;
+        for (auto I = COUNTERS_PER_DEVICE.begin (); I != COUNTERS_PER_DEVICE.end (); ++I)
+            if (I->second.nextChange () < counterDue) {
+                counterDue = I->second.nextChange ();
+                next = I;
+            }
+
+        if (counterDue > time) break;
+        next->second.advance (PAR, object (next->first >> 32, 0, next->first & 0xffffffff, PIDDISK), counterDue);
+    }
+}
+
+/*
+   The header goes in a block of fixed size, padded with a comment line, so
+   a resumed trace appends its records and rewrites the header in place.
+ */
+const size_t HEADER_BLOCK = 4096;
+
+/* Size of the header block of a trace, 0 if there is none */
+size_t headerSpace (const string & filename)
+{
+    ifstream in (filename, std::ios_base::binary);
+    string line;
+
+    if (not getline (in, line)) return 0;
+    size_t space = line.size () + 1;
+    if (in.peek () == '#' and getline (in, line)) space += line.size () + 1;
+    return space;
+}
+
+/* Writes the header padded to space bytes, which must leave room for the comment line */
+void writeHeader (ostream & out, const string & header, size_t space)
+{
+    out << header << "\n#" << string (space - header.size () - 3, ' ') << "\n";
+}
+
+/* Appends the records of the current run to a trace */
+void appendRecords (ostream & PAR, istream & TRACE)
+{
+    if (objects->multiNode ()) {
+        string line;
+        while (getline (TRACE, line)) PAR << objects->remapCPU (line) << '\n';
+    }
+    else if (TRACE.peek () != EOF) PAR << TRACE.rdbuf();
+}
 
 /* Generates PCF File */
 void generatePCFFile(string filename)
@@ -133,7 +694,9 @@ PCF << "19    RA" << endl;
 PCF << "20    FRONTMERGE" << endl;
 PCF << "21    BACKMERGE" << endl;
 PCF << "22    ENERGY" << endl;
-PCF << "23    LAST_ELEMENT" << endl;
+PCF << "23    FUA" << endl;
+PCF << "24    DISCARD" << endl;
+PCF << "25    LAST_ELEMENT" << endl;
 
 PCF << "DEFAULT_SEMANTIC" << endl;
 
@@ -150,6 +713,9 @@ PCF << "0  100006  MERGE" << endl;
 PCF << "0  100007  READAHEAD" << endl;
 PCF << "0  100008  ENERGY5" << endl;
 PCF << "0  100009  ENERGY12" << endl;
+PCF << "0  100014  FLUSH" << endl;
+PCF << "0  100015  FUA" << endl;
+PCF << "0  100016  DISCARD" << endl;
 PCF << "VALUES" << endl;
 PCF << "0 Completed" << endl;
 PCF << "1    ISSUE" << endl;
@@ -173,7 +739,23 @@ PCF << "18    MERGE" << endl;
 PCF << "19    READAHEAD" << endl;
 PCF << "20    FRONTMERGE" << endl;
 PCF << "21    BACKMERGE" << endl;
-PCF << "22    LAST_ELEMENT" << endl;
+PCF << "22    ENERGY" << endl;
+PCF << "23    FUA" << endl;
+PCF << "24    DISCARD" << endl;
+PCF << "25    LAST_ELEMENT" << endl;
+
+PCF << endl;
+PCF << "EVENT_TYPE" << endl;
+PCF << "0  100017  Flush/FUA requests in driver" << endl;
+
+if (COUNTERS) {
+PCF << endl;
+PCF << "EVENT_TYPE" << endl;
+PCF << "0  100010  Requests in scheduler" << endl;
+PCF << "0  100011  Requests in driver" << endl;
+PCF << "0  100012  Bytes in driver" << endl;
+PCF << "0  100013  Bandwidth (KB/s)" << endl;
+}
 
 PCF.close();
 
@@ -184,20 +766,18 @@ class traceLine
 {
 private:
     blk_io_trace trace;
+    unsigned int node;
 public:
-    traceLine (const struct blk_io_trace &tr, ifstream & ifs) {
+    traceLine (const struct blk_io_trace &tr, const string & pdu, unsigned int n = 0, unsigned long long cgroup = 0) : node (n) {
         memcpy (&trace, &tr, sizeof (blk_io_trace));
-        char pName[trace.pdu_len];
 
-        if (trace.pdu_len > 0 ) {
-            ifs.read ((char *) &pName, trace.pdu_len);
-        }
+        /* The queue runs in the context of the submitter, completions may run anywhere */
+        if (cgroup and trace.pdu_len == 0 and (trace.action & 0xffff) == __BLK_TA_QUEUE)
+            PID2CGROUP[nodeKey (node, trace.pid)] = cgroup;
 
         // Additional data is the name of the process or a remap action (not processed)
         if (trace.action == BLK_TN_PROCESS) {
-            pid2name[trace.pid] = pName;
-            RPIDS[numPID] = trace.pid;
-            PIDS[trace.pid] = numPID++;
+            pid2name[nodeKey (node, trace.pid)] = pdu.substr (0, strnlen (pdu.data (), pdu.size ()));
         }
     }
 
@@ -246,6 +826,11 @@ public:
         return result;
     }
 
+    /* Flush or FUA request, the ones other requests wait for */
+    bool ordered () const {
+        return trace.action & (BLK_TC_ACT(BLK_TC_FLUSH) | BLK_TC_ACT(BLK_TC_FUA));
+    }
+
     // Converts trace.action to the correct mapped eventid-eventvalue
     void convertEvent (unsigned int & EVENTID, unsigned int &EVENTV)
     {
@@ -257,7 +842,20 @@ public:
         int f = trace.action & BLK_TC_ACT(BLK_TC_FLUSH);
         int u = trace.action & BLK_TC_ACT(BLK_TC_FUA);
 
-        if (m) {
+        /* Discards, flushes and FUA writes have their own event types */
+        if (d) {
+            EVENTV = static_cast<unsigned int>(EVENTS::DISCARD);
+            EVENTID = static_cast<unsigned int> (TYPES::DISCARD);
+        }
+        else if (f) {
+            EVENTV = static_cast<unsigned int>(EVENTS::FLUSH);
+            EVENTID = static_cast<unsigned int> (TYPES::FLUSH);
+        }
+        else if (u) {
+            EVENTV = static_cast<unsigned int>(EVENTS::FUA);
+            EVENTID = static_cast<unsigned int> (TYPES::FUA);
+        }
+        else if (m) {
             if (w)
             {
                 EVENTV = static_cast<unsigned int>(EVENTS::WRITEMETA);
@@ -297,6 +895,8 @@ public:
             lastTimeStamp =  trace.time;
             int action = trace.action & 0xffff;
 
+            if (COUNTERS) decayCounters (PAR, trace.time);
+
             unsigned int EVENTV = 0;
             unsigned int EVENTID = 0;
             switch (action) {
@@ -304,28 +904,35 @@ public:
             {
 
                 convertEvent(EVENTID, EVENTV);
+                if (LANES) PAR << "2:" << laneObject (node, trace.cpu, true) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+
                 // We need to insert as many completes as infly operations we have
-                auto I = INFLY_PER_EVENT[EVENTID].begin();
+                INFLY_PER_EVENT & infly = INFLY_PER_DEVICE[nodeKey (node, trace.device)];
+                auto I = infly[EVENTID].begin();
 
-                while ( I != INFLY_PER_EVENT[EVENTID].end())
+                while ( I != infly[EVENTID].end())
                 {
                     // I -> is a map per pid
                     /* MPID es el map < pid, vector > */
                     int num = removeInfly(I->second, P(trace.sector, trace.bytes)); // paso el vector
                     EVENTV = static_cast<unsigned int>(EVENTS::COMPLETE);
-                    if ( PIDS.find(I->first) == PIDS.end() ) cout << "Not exists " << I->first << endl;
                     for (int i = 0; i<num; i++)
                     {
-                        PAR << "2:" << trace.cpu+1 << ":1:1:" << PIDS[I->first] << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                        PAR << "2:" << object (node, trace.cpu, trace.device, I->first) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
                     
                         if (COMMS and I->first != PIDDISK) PAR << "3:"
-                        << trace.cpu+1 << ":1:1:" << PIDDISK << ":" << (unsigned long long) (trace.time) << ":"  << trace.time << ":"
-                        << trace.cpu+1 << ":1:1:" << PIDS[I->first] << ":" << (unsigned long long) (trace.time) << ":"  << trace.time << ":" << trace.bytes << ":" << trace.sector << endl;
+                        << object (node, trace.cpu, trace.device, PIDDISK) << ":" << (unsigned long long) (trace.time) << ":"  << trace.time << ":"
+                        << object (node, trace.cpu, trace.device, I->first) << ":" << (unsigned long long) (trace.time) << ":"  << trace.time << ":" << trace.bytes << ":" << trace.sector << endl;
                       }
                     ++I;
                 }
-                PAR << "2:" << trace.cpu+1 << ":1:1:" << PIDS[trace.pid] << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                PAR << "2:" << object (node, trace.cpu, trace.device, trace.pid) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
 
+                if (ordered ()) {
+                    unsigned int & n = ORDERED_PER_DEVICE[nodeKey (node, trace.device)];
+                    if (n > 0) n--;
+                    PAR << "2:" << object (node, trace.cpu, trace.device, PIDDISK) << ":" << (unsigned long long) (trace.time) << ":" << static_cast<unsigned int> (TYPES::ORDERED) << ":" << n << endl;
+                }
             }
             break;
 
@@ -334,9 +941,9 @@ public:
             {
                 convertEvent(EVENTID, EVENTV);
 
-                PAR << "2:" << trace.cpu+1 << ":1:1:" << PIDS[trace.pid] << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
-                INFLY_PER_EVENT[EVENTID][trace.pid].push_back( P (trace.sector, trace.bytes) );
-                if (COMMS) WANT_SEND[trace.pid].push_back (trace);
+                PAR << "2:" << object (node, trace.cpu, trace.device, trace.pid) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                INFLY_PER_DEVICE[nodeKey (node, trace.device)][EVENTID][trace.pid].push_back( P (trace.sector, trace.bytes) );
+                if (COMMS) WANT_SEND[nodeKey (node, trace.pid)].push_back (trace);
             }
             break;
 
@@ -347,15 +954,19 @@ public:
             {
                 convertEvent(EVENTID, EVENTV);
 
-                PAR << "2:" << trace.cpu+1 << ":1:1:" << PIDDISK << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
-                INFLY_PER_EVENT[EVENTID][1].push_back( P (trace.sector, trace.bytes) );
+                PAR << "2:" << object (node, trace.cpu, trace.device, PIDDISK) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                if (LANES) PAR << "2:" << laneObject (node, trace.cpu, false) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                INFLY_PER_DEVICE[nodeKey (node, trace.device)][EVENTID][PIDDISK].push_back( P (trace.sector, trace.bytes) );
+
+                if (ordered ())
+                    PAR << "2:" << object (node, trace.cpu, trace.device, PIDDISK) << ":" << (unsigned long long) (trace.time) << ":" << static_cast<unsigned int> (TYPES::ORDERED) << ":" << ++ORDERED_PER_DEVICE[nodeKey (node, trace.device)] << endl;
                 
-                unsigned long long originalsendTime = search_time (WANT_SEND[trace.pid],true);
+                unsigned long long originalsendTime = search_time (WANT_SEND[nodeKey (node, trace.pid)],true);
 
                 /* Generate communication line */
-                if (COMMS) PAR << "3:" << trace.cpu+1 << ":1:1:" << PIDS[trace.pid] << ":" << (unsigned long long) (originalsendTime) << ":"
+                if (COMMS) PAR << "3:" << object (node, trace.cpu, trace.device, trace.pid) << ":" << (unsigned long long) (originalsendTime) << ":"
                     << (unsigned long long) ( trace.time ) << ":"
-                    << trace.cpu+1 << ":1:1:" << PIDDISK << ":" <<  (unsigned long long) trace.time << ":"
+                    << object (node, trace.cpu, trace.device, PIDDISK) << ":" <<  (unsigned long long) trace.time << ":"
                     << (unsigned long long) (trace.time ) << ":"
                     << trace.bytes << ":" << trace.sector << endl;
             }
@@ -368,7 +979,7 @@ public:
                 EVENTV = static_cast<unsigned int>(EVENTS::MERGE);
                 EVENTID = static_cast<unsigned int> (TYPES::MERGE);
 
-                PAR << "2:" << trace.cpu+1 << ":1:1:" << PIDS[trace.pid] << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                PAR << "2:" << object (node, trace.cpu, trace.device, trace.pid) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
                 break;
 
             case __BLK_TA_QUEUE:
@@ -376,35 +987,378 @@ public:
                     EVENTV = static_cast<unsigned int>(EVENTS::RA);
                     EVENTID = static_cast<unsigned int> (TYPES::RA);
 
-                    PAR << "2:" << trace.cpu+1 << ":1:1:" << PIDS[trace.pid] << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
+                    PAR << "2:" << object (node, trace.cpu, trace.device, trace.pid) << ":" << (unsigned long long) (trace.time) << ":" << EVENTID << ":" << EVENTV << endl;
                 }
                 break;
            }
+
+            if (COUNTERS) {
+                deviceCounters & dc = COUNTERS_PER_DEVICE[nodeKey (node, trace.device)];
+                dc.update (trace);
+                dc.emit (PAR, object (node, trace.cpu, trace.device, PIDDISK), trace.time);
+                counterDue = min (counterDue, dc.nextChange ());
+            }
+        }
+    }
+};
+
+
+/*
+   An input trace, decoded by its own thread into a bounded queue of record
+   blocks, so the inputs are read concurrently while main merges them in
+   time order. Times are shifted by the clock alignment of the input.
+ */
+class inputStream
+{
+public:
+    struct record {
+        blk_io_trace trace;
+        string pdu;
+        unsigned long long cgroup;
+        unsigned long long end;   /* File offset after the record */
+    };
+
+private:
+    static const size_t BLOCK = 4096;
+    static const size_t MAXBLOCKS = 8;
+
+    typedef vector < record > block;
+
+    traceReader reader;
+    deque < block > blocks;
+    mutex m;
+    condition_variable cv;
+    bool done;
+    atomic < bool > stopping; /* Also read by the worker between records, without the lock */
+    block current;
+    size_t pos;
+    thread worker;
+
+    void push (block & b) {
+        unique_lock < mutex > lock (m);
+        cv.wait (lock, [this] { return stopping or blocks.size () < MAXBLOCKS; });
+        blocks.push_back (move (b));
+        cv.notify_all ();
+    }
+
+    void run () {
+        block b;
+        b.reserve (BLOCK);
+        record r;
+
+        while (not stopping and reader.next (r.trace, r.pdu, r.cgroup)) {
+            r.trace.time += shift;
+            r.end = reader.offset ();
+            b.push_back (r);
+            if (b.size () == BLOCK) {
+                push (b);
+                b.clear ();
+                b.reserve (BLOCK);
+            }
+        }
+        if (not b.empty ()) push (b);
+
+        unique_lock < mutex > lock (m);
+        done = true;
+        cv.notify_all ();
+    }
+
+public:
+    string filename;
+    long long offset;       /* Clock offset of the input (ns) */
+    unsigned long long shift; /* Time added to the records, so that no time is negative */
+    unsigned long long consumed; /* File offset after the last record merged, set by the merge */
+
+    inputStream (const string & f, long long o) : done (false), stopping (false), pos (0), filename (f),
+        offset (o), shift (0), consumed (0) {}
+
+    bool open () {
+        return reader.open (filename, consumed);
+    }
+
+    /*
+       Estimates the clock offset of the input, wall clock minus trace time,
+       from its first timestamp notify (blktrace writes one when it starts).
+       Returns false if the input has none in its first records.
+     */
+    bool estimateOffset (long long & estimate, unsigned long long & firstTime) {
+        traceReader prescan;
+        blk_io_trace trace;
+        string pdu;
+        bool first = true;
+
+        if (not prescan.open (filename)) return false;
+
+        for (int i = 0; i < 100000 and prescan.next (trace, pdu); i++) {
+            if (first) firstTime = trace.time;
+            first = false;
+
+            if (trace.action == BLK_TN_TIMESTAMP and pdu.size () >= 2 * sizeof (__u32)) {
+                __u32 words[2];
+                memcpy (words, pdu.data (), sizeof (words));
+                if (prescan.swapped ()) {
+                    words[0] = __builtin_bswap32 (words[0]);
+                    words[1] = __builtin_bswap32 (words[1]);
+                }
+                estimate = (long long) words[0] * 1000000000LL + words[1] - (long long) trace.time;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start () {
+        worker = thread (&inputStream::run, this);
+    }
+
+    /* Next record in time order, NULL at the end of the input */
+    record * next () {
+        if (pos == current.size ()) {
+            unique_lock < mutex > lock (m);
+            cv.wait (lock, [this] { return done or not blocks.empty (); });
+            if (blocks.empty ()) return NULL;
+            current = move (blocks.front ());
+            blocks.pop_front ();
+            pos = 0;
+            cv.notify_all ();
         }
+        return &current[pos++];
+    }
+
+    /* Stops the reader thread, the records not merged yet are left for a later run */
+    void stop () {
+        unique_lock < mutex > lock (m);
+        stopping = true;
+        cv.notify_all ();
+    }
+
+    void close () {
+        worker.join ();
+        reader.close ();
+        reader.report (filename);
     }
 };
 
+/*
+   Checkpoint: per input the file offset and clock alignment, and all the
+   state needed to go on converting (names, object model, in flight
+   requests, counters), so that a later run appends the records of the new
+   data of the (growing) inputs to the existing paraver trace.
+ */
+bool loadCheckpoint (const string & filename, vector < inputStream * > & inputs, vector < unsigned int > & oldBase)
+{
+    ifstream in;
+    if (not openCheckpoint (in, filename, "blktrace2prv")) return false;
+
+    size_t n;
+    unsigned int lanes, energy, comms, counters, cgroups;
+    in >> lanes >> energy >> comms >> counters >> cgroups;
+    if (lanes != APPL_LANES or energy != APPL_ENERGY or comms != COMMS or counters != COUNTERS or cgroups != CGROUPS) {
+        cerr << "The options do not match the ones of the checkpoint " << filename << endl;
+        exit(-1);
+    }
+
+    in >> n;
+    if (n != inputs.size ()) {
+        cerr << "The checkpoint " << filename << " has " << n << " input files" << endl;
+        exit(-1);
+    }
+    for (auto in_ : inputs) {
+        if (loadString (in) != in_->filename) {
+            cerr << "The checkpoint " << filename << " belongs to other input files" << endl;
+            exit(-1);
+        }
+        in >> in_->consumed >> in_->offset >> in_->shift;
+    }
+
+    in >> lastTimeStamp >> prvSize;
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long key;
+        in >> key;
+        pid2name[key] = loadString (in);
+    }
+
+    oldBase = objects->load (in);
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long device;
+        size_t numEvents;
+        in >> device >> numEvents;
+        for (size_t e = 0; e < numEvents; e++) {
+            unsigned int event;
+            size_t numPids;
+            in >> event >> numPids;
+            for (size_t p = 0; p < numPids; p++) {
+                unsigned int pid;
+                size_t numInfly;
+                in >> pid >> numInfly;
+                vector < P > & v = INFLY_PER_DEVICE[device][event][pid];
+                for (size_t j = 0; j < numInfly; j++) {
+                    P o;
+                    in >> o.first >> o.second;
+                    v.push_back (o);
+                }
+            }
+        }
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long key;
+        size_t numSend;
+        in >> key >> numSend;
+        vector < blk_io_trace > & v = WANT_SEND[key];
+        for (size_t j = 0; j < numSend; j++) {
+            blk_io_trace t;
+            memset (&t, 0, sizeof (t));
+            in >> t.time >> t.sector >> t.bytes;
+            v.push_back (t);
+        }
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long key;
+        in >> key;
+        COUNTERS_PER_DEVICE[key].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long key;
+        in >> key;
+        in >> PID2CGROUP[key];
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long key;
+        in >> key;
+        in >> ORDERED_PER_DEVICE[key];
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        pair < unsigned int, unsigned long long > key;
+        in >> key.first >> key.second;
+        in >> CGROUP_TASKS[key];
+    }
+
+    if (in.fail ()) {
+        cerr << "The checkpoint " << filename << " is corrupted" << endl;
+        exit(-1);
+    }
+    return true;
+}
+
+void saveCheckpoint (const string & filename, const vector < inputStream * > & inputs)
+{
+    ofstream out;
+    createCheckpoint (out, filename, "blktrace2prv");
+
+    out << APPL_LANES << " " << APPL_ENERGY << " " << COMMS << " " << COUNTERS << " " << CGROUPS << "\n";
+
+    out << inputs.size () << "\n";
+    for (auto in : inputs) {
+        saveString (out, in->filename);
+        out << in->consumed << " " << in->offset << " " << in->shift << "\n";
+    }
+
+    out << lastTimeStamp << " " << prvSize << "\n";
 
+    out << pid2name.size () << "\n";
+    for (auto & I : pid2name) {
+        out << I.first << " ";
+        saveString (out, I.second);
+        out << "\n";
+    }
+
+    objects->save (out);
+
+    out << INFLY_PER_DEVICE.size () << "\n";
+    for (auto & D : INFLY_PER_DEVICE) {
+        out << D.first << " " << D.second.size () << "\n";
+        for (auto & E : D.second) {
+            out << E.first << " " << E.second.size () << "\n";
+            for (auto & I : E.second) {
+                out << I.first << " " << I.second.size ();
+                for (auto & o : I.second) out << " " << o.first << " " << o.second;
+                out << "\n";
+            }
+        }
+    }
+
+    out << WANT_SEND.size () << "\n";
+    for (auto & W : WANT_SEND) {
+        out << W.first << " " << W.second.size ();
+        for (auto & t : W.second) out << " " << t.time << " " << t.sector << " " << t.bytes;
+        out << "\n";
+    }
+
+    out << COUNTERS_PER_DEVICE.size () << "\n";
+    for (auto & C : COUNTERS_PER_DEVICE) {
+        out << C.first << " ";
+        C.second.save (out);
+    }
+
+    out << PID2CGROUP.size () << "\n";
+    for (auto & C : PID2CGROUP) out << C.first << " " << C.second << "\n";
+
+    out << ORDERED_PER_DEVICE.size () << "\n";
+    for (auto & O : ORDERED_PER_DEVICE) out << O.first << " " << O.second << "\n";
+
+    out << CGROUP_TASKS.size () << "\n";
+    for (auto & C : CGROUP_TASKS) out << C.first.first << " " << C.first.second << " " << C.second << "\n";
+
+    if (not commitCheckpoint (out, filename))
+        cerr << "We have some problem writing the checkpoint " << filename << endl;
+}
 
 string ofilename = "";
 string efilename = "";
 int
 main (int argc, char **argv)
 {
-    string ifilename;
+    vector < inputStream * > inputs;
+    vector < string > nodeNames;
+    bool AUTOALIGN = false;
+    string checkpoint;
 
     if (argc < 2)  {
-        cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2parever -i <inputbinarytrace> -o <outputtracename> -c (include comms) -e <energy>" << endl;
+        cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2parever -i <inputbinarytrace>[@<clock offset ns>] [-i ...] -a (align clocks) -o <outputtracename> -c (include comms) -e <energy> -l (cpu lanes) -q (queue counters) -b <bandwidth window ms> -r <counter rate limit us> -k <checkpoint> -g (cgroups) -G <cgroup names>" << endl;
         exit(-1);
     }
 
     int opterr = 0;
     int c;
 
-    while ((c = getopt (argc, argv, "i:o:ce:")) != -1)
+    while ((c = getopt (argc, argv, "i:ao:ce:lqb:r:k:gG:")) != -1)
         switch (c) {
         case 'i':
-            ifilename = optarg;
+        {
+            string input = optarg;
+            long long offset = 0;
+            size_t at = input.rfind ('@');
+
+            /* Only a number after the last @ is an offset, other @ belong to the path */
+            if (at != string::npos and at + 1 < input.size ()) {
+                char * end;
+                long long o = strtoll (input.c_str () + at + 1, &end, 10);
+                if (*end == '\0') {
+                    offset = o;
+                    input = input.substr (0, at);
+                }
+            }
+            inputs.push_back (new inputStream (input, offset));
+            nodeNames.push_back (input.substr (input.rfind ('/') + 1));
+        }
+        break;
+
+        case 'a':
+            AUTOALIGN = true;
             break;
 
         case 'o':
@@ -417,11 +1371,37 @@ main (int argc, char **argv)
             ENERGY = true;
 	    efilename = optarg;
 	    break;
+        case 'l':
+            LANES = true;
+            break;
+        case 'q':
+            COUNTERS = true;
+            break;
+        case 'b':
+            BWWINDOW = stoull ((string)optarg) * 1000000ULL;
+            if (BWWINDOW == 0) BWWINDOW = 1000000;
+            break;
+        case 'r':
+            RATELIMIT = stoull ((string)optarg) * 1000ULL;
+            break;
+        case 'k':
+            checkpoint = optarg;
+            break;
+        case 'g':
+            CGROUPS = true;
+            break;
+        case 'G':
+            CGROUPS = true;
+            if (not loadCgroupNames (optarg, cgroup2name)) {
+                cerr << "We have some problem with the cgroup names file, check " << endl;
+                exit(-1);
+            }
+            break;
 
         case '?':
-            cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2parever -i <inputbinarytrace> -o <outputtracename> -c (include comms)" << endl;
+            cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2parever -i <inputbinarytrace>[@<clock offset ns>] [-i ...] -a (align clocks) -o <outputtracename> -c (include comms) -e <energy> -l (cpu lanes) -q (queue counters) -b <bandwidth window ms> -r <counter rate limit us> -k <checkpoint> -g (cgroups) -G <cgroup names>" << endl;
 
-            if (optopt == 'i')
+            if (optopt == 'i' or optopt == 'o' or optopt == 'e' or optopt == 'b' or optopt == 'r' or optopt == 'k' or optopt == 'G')
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -438,17 +1418,59 @@ main (int argc, char **argv)
 
     ofstream PAR;
     PAR.open ("tmp.prv");
-   
-    string linea;
-    double stime = -1;
 
-    ifstream ifs;
-    ifs.open (ifilename.c_str(), std::ifstream::binary);
-
-    if (!(ifs.is_open() and ifs.good())) {
-        cerr << "We have some problem with the input file, check " << endl;
+    if (inputs.empty ()) {
+        cerr << "We need at least an input file" << endl;
         exit(-1);
     }
+
+    // We generate a Virtual "thread" per device that simulates the disk activity
+    pid2name[PIDDISK] = "Disk";
+    pid2name[PIDE5] = "Energy - Logic";
+    pid2name[PIDE12] = "Energy - Mech";
+
+    unsigned int numAppl = 1;
+    if (LANES) APPL_LANES = ++numAppl;
+    if (ENERGY) APPL_ENERGY = ++numAppl;
+    objects = new objectModel (numAppl, nodeNames);
+
+    /* Resuming: inputs start at the checkpoint offsets, the new records are appended to the trace */
+    vector < unsigned int > oldBase;
+    bool RESUME = not checkpoint.empty () and loadCheckpoint (checkpoint, inputs, oldBase);
+
+    for (auto in : inputs)
+        if (not in->open ()) {
+            cerr << "We have some problem with the input file " << in->filename << ", check " << endl;
+            exit(-1);
+        }
+
+    /*
+       Clock alignment: with -a the offsets come from the timestamp notify of
+       each input, if an input has none the first records are aligned instead.
+       Inputs are shifted so that the earliest one starts at its own time.
+     */
+    if (AUTOALIGN and not RESUME) {
+        vector < long long > estimates (inputs.size ());
+        vector < unsigned long long > firstTimes (inputs.size (), 0);
+        bool all = true;
+
+        for (unsigned int i = 0; i < inputs.size (); i++)
+            all = inputs[i]->estimateOffset (estimates[i], firstTimes[i]) and all;
+
+        for (unsigned int i = 0; i < inputs.size (); i++)
+            inputs[i]->offset = all ? estimates[i] : - (long long) firstTimes[i];
+    }
+
+    if (not RESUME) {
+        long long minOffset = inputs[0]->offset;
+        for (auto in : inputs) minOffset = min (minOffset, in->offset);
+        for (auto in : inputs) in->shift = in->offset - minOffset;
+    }
+
+    if (RESUME and ENERGY) {
+        cerr << "The energy file is only converted on the first run" << endl;
+        ENERGY = false;
+    }
     
     ifstream efs;
 
@@ -461,30 +1483,43 @@ main (int argc, char **argv)
     }
 
 	
-    blk_io_trace trace;
 
-    
-    // We generate a Virtual "thread" that simulates the disk activity
-    numPID = 4;
-    PIDS[1] = 1; 
-    RPIDS[1] = 1;
-    pid2name[1] = "Disk";
-    
-    PIDS[999999+1] = 2;
-    RPIDS[2] = 999999+1;
-    pid2name[999999+1] = "Energy - Logic";
+    // k-way merge of the inputs in time order, a node per input
+    typedef pair < unsigned long long, unsigned int > HEAD;
+    priority_queue < HEAD, vector < HEAD >, greater < HEAD > > heads;
+    vector < inputStream::record * > current (inputs.size ());
+
+    for (auto in : inputs) in->start ();
+
+    for (unsigned int i = 0; i < inputs.size (); i++)
+        if ((current[i] = inputs[i]->next ()) != NULL) heads.push (HEAD (current[i]->trace.time, i));
 
-    PIDS[999999+2] = 3;
-    RPIDS[3] = 999999+2;
-    pid2name[999999+2] = "Energy - Mech";
+    /*
+       With a checkpoint and several inputs, the merge stops when an input
+       runs out, the other inputs may still receive earlier records
+     */
+    bool stopAtEnd = not checkpoint.empty () and inputs.size () > 1;
 
-    while ((ifs.is_open () and ifs.good ())) {
-        ifs.read ((char *) &trace, sizeof (blk_io_trace));
-        traceLine linea (trace, ifs);
+    while (heads.size () == inputs.size () or (not stopAtEnd and not heads.empty ())) {
+        unsigned int i = heads.top ().second;
+        heads.pop ();
+
+        traceLine linea (current[i]->trace, current[i]->pdu, i, current[i]->cgroup);
         linea.toPRV (PAR);
+        inputs[i]->consumed = current[i]->end;
+
+        if ((current[i] = inputs[i]->next ()) != NULL) heads.push (HEAD (current[i]->trace.time, i));
     }
 
-    ifs.close ();
+    for (auto in : inputs) {
+        in->stop ();
+        in->close ();
+    }
+
+    // Counters held back by the rate limit are written at the end of the trace
+    if (COUNTERS) decayCounters (PAR, lastTimeStamp);
+    for (auto & I : COUNTERS_PER_DEVICE)
+        if (I.second.hasPending ()) I.second.emit (PAR, object (I.first >> 32, 0, I.first & 0xffffffff, PIDDISK), lastTimeStamp, true);
 
     if (ENERGY)
     {
@@ -496,44 +1531,84 @@ main (int argc, char **argv)
 	   if ( initial < 0) initial = ts;
         
        unsigned int   EVENTID = static_cast<unsigned int> (TYPES::ENERGY5);
+       unsigned int task = objects->getTask (APPL_ENERGY, 0, "Energy");
 
-	PAR << "2:" << 1 << ":1:1:" << PIDS[PIDE5] << ":" << (unsigned long long) ((ts-initial)*1000000000.0) << ":" << EVENTID << ":" << ma5 << endl;
+	PAR << "2:" << 1 << ":" << APPL_ENERGY << ":" << task << ":" << objects->getThread (APPL_ENERGY, task, PIDE5) << ":" << (unsigned long long) ((ts-initial)*1000000000.0) << ":" << EVENTID << ":" << ma5 << endl;
     EVENTID = static_cast<unsigned int> (TYPES::ENERGY12);
 
-    PAR << "2:" << 1 << ":1:1:" <<  PIDS[PIDE12] << ":" << (unsigned long long) ((ts-initial)*1000000000.0) << ":" << EVENTID << ":" << ma12 << endl;
+    PAR << "2:" << 1 << ":" << APPL_ENERGY << ":" << task << ":" << objects->getThread (APPL_ENERGY, task, PIDE12) << ":" << (unsigned long long) ((ts-initial)*1000000000.0) << ":" << EVENTID << ":" << ma12 << endl;
     }
 	efs.close();
 
 
     }
 
-    // Generacion del fichero de nombres (ROW)
-    ofstream ROW;
-    ROW.open (ofilename+".row");
-    ROW << "LEVEL THREAD SIZE " << numPID << endl;
-
+    PAR.close ();
 
-    for (int i = 1; i < numPID; i++)
-    {
-        if (RPIDS.find (i) == RPIDS.end ())
-            ROW << "PID " << i << endl;
-        else
-            ROW << pid2name[ RPIDS[i] ] << endl;
+    /*
+       Resuming, the records are appended to the old trace and its header is
+       rewritten in place. The records a failed run appended after the
+       checkpoint are cut first. The whole trace is only rewritten when the
+       new header does not fit in the old block or the cpus need another
+       numbering.
+     */
+    struct stat st;
+    if (RESUME and stat ((ofilename + ".prv").c_str (), &st) == 0) {
+        if ((unsigned long long) st.st_size < prvSize) {
+            cerr << "The trace " << ofilename << ".prv does not match the checkpoint " << checkpoint << endl;
+            exit(-1);
+        }
+        if ((unsigned long long) st.st_size > prvSize) truncate ((ofilename + ".prv").c_str (), prvSize);
     }
 
+    bool inPlace = RESUME and objects->keepBases (oldBase);
 
-    ROW.close ();
-    PAR.close ();
-
-    PAR.open (ofilename+".prv");
-    // Number of cores is hardcoded (as 8)
-    PAR << "#Paraver (06/08/14 at 23:30):"<<lastTimeStamp<<":1(8):1:1(" << numPID-1 << ":1)" << endl;
-   
+    // Generacion del fichero de nombres (ROW)
+    objects->generateROWFile (ofilename);
     generatePCFFile (ofilename);
 
+    ostringstream header;
+    header << "#Paraver (06/08/14 at 23:30):" << lastTimeStamp << ":" << objects->header ();
+    size_t space = inPlace ? headerSpace (ofilename + ".prv") : 0;
+    inPlace = inPlace and space >= header.str ().size () + 3;
+
     std::ifstream TRACE("tmp.prv", std::ios_base::binary);
-    PAR << TRACE.rdbuf();
-    PAR.close();
+    if (inPlace) {
+        PAR.open (ofilename + ".prv", std::ios_base::binary | std::ios_base::app);
+        appendRecords (PAR, TRACE);
+        prvSize = PAR.tellp ();
+        PAR.close ();
+
+        std::fstream HDR (ofilename + ".prv", std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+        HDR.seekp (0);
+        writeHeader (HDR, header.str (), space);
+        HDR.close ();
+    }
+    else {
+        /* The trace is written next to the old one (kept when resuming) and renamed at the end */
+        space = max (HEADER_BLOCK, (2 * header.str ().size () + HEADER_BLOCK - 1) / HEADER_BLOCK * HEADER_BLOCK);
+        PAR.open (ofilename+".prv.tmp", std::ios_base::binary);
+        writeHeader (PAR, header.str (), space);
+
+        std::ifstream OLD;
+        if (RESUME) OLD.open (ofilename+".prv", std::ios_base::binary);
+        if (OLD.is_open ()) {
+            OLD.seekg (headerSpace (ofilename + ".prv"));
+            if (objects->multiNode () and oldBase != objects->bases ()) {
+                string line;
+                while (getline (OLD, line)) PAR << objects->remapCPU (line, &oldBase) << '\n';
+            }
+            else if (OLD.peek () != EOF) PAR << OLD.rdbuf();
+            OLD.close ();
+        }
+
+        appendRecords (PAR, TRACE);
+        prvSize = PAR.tellp ();
+        PAR.close();
+        rename ((ofilename+".prv.tmp").c_str (), (ofilename+".prv").c_str ());
+    }
     TRACE.close();
     remove("tmp.prv");
+
+    if (not checkpoint.empty ()) saveCheckpoint (checkpoint, inputs);
 }
@@ -30,10 +30,20 @@
 #include <fstream>
 #include <cstdlib>
 #include <vector>
+#include <deque>
 #include <cstring>
 #include <cstdio>
+#include <algorithm>
 #include <linux/blktrace_api.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "tracereader.h"
+#include "tracecache.h"
+#include "checkpoint.h"
+#include "cgroups.h"
+#include "devices.h"
 using namespace std;
 
 map < int, string > pid2name;
@@ -60,6 +70,8 @@ enum EVENTS {
     RA,
     FRONTMERGE,
     BACKMERGE,
+    FUA,
+    DISCARD,
     LAST_ELEMENT
 };
 
@@ -67,6 +79,467 @@ enum EVENTS {
 typedef vector < unsigned int >COUNT;
 map < int, COUNT > mCOUNT;
 
+/* Same counts per cgroup (0 for records without a cgroup id) */
+map < unsigned long long, COUNT > mCOUNT_CG;
+map < unsigned long long, string > cgroup2name;
+
+/*
+   log2 histograms: bucket 0 holds the value 0 and bucket i holds
+   values in [2^(i-1), 2^i)
+ */
+const int HISTO_BUCKETS = 65;
+typedef vector < unsigned long long > HISTO;
+
+int log2bucket (unsigned long long value)
+{
+    return value ? 64 - __builtin_clzll (value) : 0;
+}
+
+unsigned long long bucketLow (int bucket)
+{
+    return bucket ? 1ULL << (bucket - 1) : 0;
+}
+
+/*
+   Spatial locality of the dispatched (sent to driver) requests.
+   The seek distance is measured in sectors from the end of the previous
+   dispatch, so a distance of 0 is a sequential access.
+ */
+class locality
+{
+public:
+    unsigned long long dispatches;
+    unsigned long long sequential;
+    unsigned long long lastEnd;
+    HISTO seek;
+    HISTO size;
+
+    locality () : dispatches (0), sequential (0), lastEnd (0),
+        seek (HISTO_BUCKETS, 0), size (HISTO_BUCKETS, 0) {}
+
+    void add (unsigned long long sector, unsigned int bytes) {
+        if (dispatches > 0) {
+            unsigned long long distance = (sector > lastEnd) ? sector - lastEnd : lastEnd - sector;
+            seek[log2bucket (distance)]++;
+            if (distance == 0) sequential++;
+        }
+
+        size[log2bucket (bytes)]++;
+        dispatches++;
+        lastEnd = sector + (bytes >> 9);
+    }
+
+    /* Percentage of dispatches that start where the previous one ended */
+    double sequentialPct () const {
+        if (dispatches < 2) return 0.0;
+        return 100.0 * sequential / (dispatches - 1);
+    }
+
+    void save (ostream & out) const {
+        out << dispatches << " " << sequential << " " << lastEnd << "\n";
+        saveSparse (out, seek);
+        saveSparse (out, size);
+    }
+
+    void load (istream & in) {
+        in >> dispatches >> sequential >> lastEnd;
+        loadSparse (in, seek);
+        loadSparse (in, size);
+    }
+};
+
+typedef pair < int, unsigned int > PIDDEV;
+map < unsigned int, locality > mLOCALITY_DEV;
+map < PIDDEV, locality > mLOCALITY_PID;
+
+/*
+   Sector heat map with a fixed number of LBA buckets and time bins.
+   When an access falls outside the covered sector range or time span, the
+   range is doubled and adjacent cells are folded, so memory stays fixed
+   whatever the trace length or the device size.
+ */
+const int HEAT_LBA_BUCKETS = 64;
+const int HEAT_TIME_BINS = 256;
+
+class heatMap
+{
+public:
+    unsigned long long startTime;
+    unsigned long long binWidth;    /* ns per time bin */
+    unsigned long long bucketWidth; /* sectors per LBA bucket */
+    vector < unsigned long long > cells;  /* time bin major */
+
+    heatMap () : startTime (0), binWidth (1000000), bucketWidth (1 << 15),
+        cells (HEAT_LBA_BUCKETS * HEAT_TIME_BINS, 0) {}
+
+    unsigned long long & cell (int bin, int bucket) {
+        return cells[bin * HEAT_LBA_BUCKETS + bucket];
+    }
+
+    void foldTime () {
+        for (int i = 0; i < HEAT_TIME_BINS; i++)
+            for (int b = 0; b < HEAT_LBA_BUCKETS; b++) {
+                unsigned long long v = 0;
+                if (2 * i + 1 < HEAT_TIME_BINS) v = cell (2 * i, b) + cell (2 * i + 1, b);
+                cell (i, b) = v;
+            }
+        binWidth *= 2;
+    }
+
+    void foldSectors () {
+        for (int i = 0; i < HEAT_TIME_BINS; i++)
+            for (int b = 0; b < HEAT_LBA_BUCKETS; b++) {
+                unsigned long long v = 0;
+                if (2 * b + 1 < HEAT_LBA_BUCKETS) v = cell (i, 2 * b) + cell (i, 2 * b + 1);
+                cell (i, b) = v;
+            }
+        bucketWidth *= 2;
+    }
+
+    void add (unsigned long long time, unsigned long long sector) {
+        if (time < startTime) time = startTime;
+        while ((time - startTime) / binWidth >= HEAT_TIME_BINS) foldTime ();
+        while (sector / bucketWidth >= HEAT_LBA_BUCKETS) foldSectors ();
+        cell ((time - startTime) / binWidth, sector / bucketWidth)++;
+    }
+
+    void save (ostream & out) const {
+        out << startTime << " " << binWidth << " " << bucketWidth << "\n";
+        saveSparse (out, cells);
+    }
+
+    void load (istream & in) {
+        in >> startTime >> binWidth >> bucketWidth;
+        loadSparse (in, cells);
+    }
+};
+
+map < unsigned int, heatMap > mHEAT;
+
+/* Request sizes per pid, at queue, insert and dispatch, and merged bytes */
+enum STAGES {
+    SQUEUE = 0,
+    SINSERT,
+    SDISPATCH,
+    LAST_STAGE
+};
+
+class sizes
+{
+public:
+    HISTO histo[LAST_STAGE][2];   /* Per stage, read (0) or write (1) */
+    unsigned long long requests[LAST_STAGE];
+    unsigned long long bytes[LAST_STAGE];
+    unsigned long long frontBytes;
+    unsigned long long backBytes;
+
+    sizes () : frontBytes (0), backBytes (0) {
+        for (int i = 0; i < LAST_STAGE; i++) {
+            histo[i][0] = histo[i][1] = HISTO (HISTO_BUCKETS, 0);
+            requests[i] = bytes[i] = 0;
+        }
+    }
+
+    void save (ostream & out) const {
+        for (int i = 0; i < LAST_STAGE; i++) {
+            out << requests[i] << " " << bytes[i] << "\n";
+            saveSparse (out, histo[i][0]);
+            saveSparse (out, histo[i][1]);
+        }
+        out << frontBytes << " " << backBytes << "\n";
+    }
+
+    void load (istream & in) {
+        for (int i = 0; i < LAST_STAGE; i++) {
+            in >> requests[i] >> bytes[i];
+            loadSparse (in, histo[i][0]);
+            loadSparse (in, histo[i][1]);
+        }
+        in >> frontBytes >> backBytes;
+    }
+
+    /* Empty requests (flushes) only go to the histograms */
+    void add (int stage, bool write, unsigned int b) {
+        histo[stage][write][log2bucket (b)]++;
+        if (b == 0) return;
+        requests[stage]++;
+        bytes[stage] += b;
+    }
+
+    /* Bytes per dispatch vs bytes per queue of the requests with data, > 1 when merging grows the requests */
+    string amplification () const {
+        if (requests[SQUEUE] == 0 or requests[SDISPATCH] == 0 or bytes[SQUEUE] == 0) return "-";
+
+        ostringstream output;
+        output << fixed << setprecision (2) <<
+               ((double) bytes[SDISPATCH] / requests[SDISPATCH]) / ((double) bytes[SQUEUE] / requests[SQUEUE]);
+        return output.str ();
+    }
+};
+
+map < int, sizes > mSIZES;
+map < unsigned long long, sizes > mSIZES_CG;
+
+string amplification (int pid)
+{
+    auto I = mSIZES.find (pid);
+    return I == mSIZES.end () ? "-" : I->second.amplification ();
+}
+
+string cgroupAmplification (unsigned long long cgroup)
+{
+    auto I = mSIZES_CG.find (cgroup);
+    return I == mSIZES_CG.end () ? "-" : I->second.amplification ();
+}
+
+/*
+   Requests between queue and completion, by device and sector.
+   A back merged bio is dropped (its request keeps the queue time of the
+   first bio) and a front merged one takes over the request, which now
+   starts at its sector. Flush and FUA requests are kept by stalls instead.
+ */
+struct pending {
+    unsigned long long queued;
+    unsigned long long dispatched;  /* 0 until dispatched */
+    unsigned long long cgroup;
+    int pid;
+    unsigned int kinds;             /* ORDERING bits */
+};
+
+typedef pair < unsigned int, unsigned long long > DEVSECTOR;
+map < DEVSECTOR, pending > mPENDING;
+
+/*
+   Pid that queued each request not dispatched yet. Dispatches often run in
+   a kworker or an interrupt, so their sizes and locality are charged to
+   the queuer.
+ */
+typedef map < DEVSECTOR, int > QUEUERS;
+QUEUERS mQUEUER;
+
+/*
+   Follows the queuer of the requests through a record. Returns the pid the
+   record is charged to: the queuer for a dispatch, else the pid itself.
+ */
+int followQueuer (QUEUERS & queuers, __u32 action, int pid, unsigned int device, unsigned long long sector,
+                  unsigned int bytes)
+{
+    DEVSECTOR key (device, sector);
+
+    switch (action & 0xffff) {
+    case __BLK_TA_QUEUE:
+        queuers[key] = pid;
+        break;
+
+    case __BLK_TA_BACKMERGE:
+        queuers.erase (key);
+        break;
+
+    case __BLK_TA_FRONTMERGE: {
+        /* The request now starts at the merged bio, it keeps its queuer */
+        auto Q = queuers.find (DEVSECTOR (device, sector + (bytes >> 9)));
+        if (Q == queuers.end ()) break;
+        int queuer = Q->second;
+        queuers.erase (Q);
+        queuers[key] = queuer;
+        break;
+    }
+
+    case __BLK_TA_ISSUE: {
+        auto Q = queuers.find (key);
+        if (Q == queuers.end ()) break;
+        pid = Q->second;
+        queuers.erase (Q);
+        break;
+    }
+    }
+    return pid;
+}
+
+/*
+   Flush, FUA and discard requests per pid: bytes queued, and completed
+   requests with their queue to complete latency (ns). Their number is in
+   COUNT. Stalled and waited are the normal requests of the pid queued
+   while a flush or FUA was in flight, and the ns they waited for dispatch.
+ */
+enum ORDERING {
+    OFLUSH = 0,
+    OFUA,
+    ODISCARD,
+    LAST_ORDERING
+};
+
+/* Requests that other requests have to wait for */
+const unsigned int ORDERED = (1 << OFLUSH) | (1 << OFUA);
+
+class ordering
+{
+public:
+    unsigned long long bytes[LAST_ORDERING];
+    unsigned long long completed[LAST_ORDERING];
+    unsigned long long latency[LAST_ORDERING];
+    unsigned long long latencyMax[LAST_ORDERING];
+    unsigned long long stalled;
+    unsigned long long waited;
+
+    ordering () : stalled (0), waited (0) {
+        for (int k = 0; k < LAST_ORDERING; k++) bytes[k] = completed[k] = latency[k] = latencyMax[k] = 0;
+    }
+
+    void save (ostream & out) const {
+        for (int k = 0; k < LAST_ORDERING; k++)
+            out << bytes[k] << " " << completed[k] << " " << latency[k] << " " << latencyMax[k] << " ";
+        out << stalled << " " << waited << "\n";
+    }
+
+    void load (istream & in) {
+        for (int k = 0; k < LAST_ORDERING; k++)
+            in >> bytes[k] >> completed[k] >> latency[k] >> latencyMax[k];
+        in >> stalled >> waited;
+    }
+};
+
+map < int, ordering > mORDERING;
+
+/*
+   A flush or FUA whose completion is lost (or was never traced) stops
+   stalling the device after this time, the default block layer timeout.
+ */
+const unsigned long long ORDERTIMEOUT = 30000000000ULL;
+
+/*
+   Ordering stalls of a device: a window lasts while a flush or FUA is in
+   flight (queued, not completed). Normal requests queued in a window wait
+   until they are dispatched or the window ends, whatever comes first.
+   Empty flushes all sit at sector 0, so the flush and FUA requests are
+   kept in queue order and dispatches and completions match the oldest one
+   of the same kind.
+ */
+class stalls
+{
+public:
+    deque < pending > inflight;
+    unsigned long long start;
+    map < unsigned long long, pair < unsigned long long, int > > waiting;  /* sector, queue time and pid */
+    unsigned long long windows;
+    unsigned long long duration, durationMax;
+    unsigned long long queued;
+    unsigned long long waited;
+
+    stalls () : start (0), windows (0), duration (0), durationMax (0), queued (0), waited (0) {}
+
+    void acquire (const pending & p) {
+        if (inflight.empty ()) start = p.queued;
+        inflight.push_back (p);
+    }
+
+    /* Oldest flush or FUA of the same kinds, else of any ordered kind. Dispatches skip the dispatched ones */
+    deque < pending >::iterator match (unsigned int kinds, bool dispatch) {
+        auto any = inflight.end ();
+
+        for (auto I = inflight.begin (); I != inflight.end (); ++I) {
+            if (dispatch and I->dispatched) continue;
+            if ((I->kinds & ORDERED) == (kinds & ORDERED)) return I;
+            if (any == inflight.end ()) any = I;
+        }
+        return any;
+    }
+
+    void release (deque < pending >::iterator I, unsigned long long time) {
+        inflight.erase (I);
+        if (not inflight.empty ()) return;
+
+        windows++;
+        duration += time - start;
+        durationMax = max (durationMax, time - start);
+        for (auto & W : waiting) wait (W.second, time);
+        waiting.clear ();
+    }
+
+    /* Drops the flush and FUA requests older than ORDERTIMEOUT, the window ends when they expire */
+    void expire (unsigned long long time) {
+        while (not inflight.empty () and time - inflight.front ().queued > ORDERTIMEOUT)
+            release (inflight.begin (), inflight.front ().queued + ORDERTIMEOUT);
+    }
+
+    void wait (const pair < unsigned long long, int > & w, unsigned long long time) {
+        waited += time - w.first;
+        mORDERING[w.second].stalled++;
+        mORDERING[w.second].waited += time - w.first;
+    }
+
+    void save (ostream & out) const {
+        out << start << " " << windows << " " << duration << " " << durationMax << " " <<
+            queued << " " << waited << " " << inflight.size ();
+        for (auto & p : inflight)
+            out << " " << p.queued << " " << p.dispatched << " " << p.cgroup << " " << p.pid << " " << p.kinds;
+        out << " " << waiting.size ();
+        for (auto & W : waiting) out << " " << W.first << " " << W.second.first << " " << W.second.second;
+        out << "\n";
+    }
+
+    void load (istream & in) {
+        size_t n = 0;
+        in >> start >> windows >> duration >> durationMax >> queued >> waited >> n;
+        for (size_t i = 0; i < n and in.good (); i++) {
+            pending p;
+            in >> p.queued >> p.dispatched >> p.cgroup >> p.pid >> p.kinds;
+            inflight.push_back (p);
+        }
+        in >> n;
+        for (size_t i = 0; i < n and in.good (); i++) {
+            unsigned long long sector;
+            in >> sector;
+            in >> waiting[sector].first >> waiting[sector].second;
+        }
+    }
+};
+
+map < unsigned int, stalls > mSTALLS;
+
+/* Queue to complete and dispatch to complete latencies, in ns */
+class latency
+{
+public:
+    unsigned long long requests;
+    unsigned long long q2c, q2cMax;
+    unsigned long long dispatched;
+    unsigned long long d2c, d2cMax;
+
+    latency () : requests (0), q2c (0), q2cMax (0), dispatched (0), d2c (0), d2cMax (0) {}
+
+    void add (const pending & p, unsigned long long time) {
+        requests++;
+        q2c += time - p.queued;
+        q2cMax = max (q2cMax, time - p.queued);
+        if (p.dispatched) {
+            dispatched++;
+            d2c += time - p.dispatched;
+            d2cMax = max (d2cMax, time - p.dispatched);
+        }
+    }
+
+    void save (ostream & out) const {
+        out << requests << " " << q2c << " " << q2cMax << " " << dispatched << " " << d2c << " " << d2cMax << "\n";
+    }
+
+    void load (istream & in) {
+        in >> requests >> q2c >> q2cMax >> dispatched >> d2c >> d2cMax;
+    }
+};
+
+map < unsigned long long, latency > mLATENCY_CG;
+
+string cgroupName (unsigned long long cgroup)
+{
+    return cgroupName (cgroup2name, cgroup);
+}
+
+string pidName (int pid)
+{
+    return pid2name[pid];
+}
+
 /*
    traceLine is a basic class to process a trace line from blktrace.
    If the trace line includes a payload (used by blktrace to output process names),
@@ -79,18 +552,15 @@ class traceLine
 {
 private:
     blk_io_trace trace;
+    unsigned long long cgroup;
+    int queuer;  /* Pid the record is charged to, set by follow () */
 public:
-    traceLine (const struct blk_io_trace &tr, ifstream & ifs) {
+    traceLine (const struct blk_io_trace &tr, const string & pdu, unsigned long long cg = 0) : cgroup (cg), queuer (tr.pid) {
         memcpy (&trace, &tr, sizeof (blk_io_trace));
-        char pName[trace.pdu_len];
-
-        if (trace.pdu_len > 0 ) {
-            ifs.read ((char *) &pName, trace.pdu_len);
-        }
 
         // Additional data is the name of the process or a remap action (not processed)
         if (trace.action == BLK_TN_PROCESS) {
-            pid2name[trace.pid] = pName;
+            pid2name[trace.pid] = pdu.substr (0, strnlen (pdu.data (), pdu.size ()));
         }
     }
 
@@ -100,98 +570,451 @@ public:
             COUNT tc = COUNT (LAST_ELEMENT, 0); /* Inits counting structure for pid */
             mC[trace.pid] = tc;
         }
-        else if (trace.pdu_len == 0) { /* Only count if is a std trace line */
-            // ISSUE
-            COUNT & tC = mC[trace.pid];
-            int action = trace.action & 0xffff;
-            int w = trace.action & BLK_TC_ACT(BLK_TC_WRITE);
-            int a = trace.action & BLK_TC_ACT(BLK_TC_AHEAD);
-            int s = trace.action & BLK_TC_ACT(BLK_TC_SYNC);
-            int m = trace.action & BLK_TC_ACT(BLK_TC_META);
-            int d = trace.action & BLK_TC_ACT(BLK_TC_DISCARD);
-            int f = trace.action & BLK_TC_ACT(BLK_TC_FLUSH);
-            int u = trace.action & BLK_TC_ACT(BLK_TC_FUA);
-
-            switch (action) {
-            case __BLK_TA_COMPLETE:
-                tC[COMPLETE]++;
-                
-
-                if (s) {
-                    if (w) tC[CWRITESYNC]++;    // Writes/READS on I
-                    else tC[CREADSYNC]++;
-                }
-                else if (w) tC[CWRITE]++;
-                else tC[CREAD]++;  // Writes/READS on I
+        else if (trace.pdu_len == 0) /* Only count if is a std trace line */
+            tally (mC[trace.pid]);
+    }
 
-                break;
+    /* Counts the events of the trace line by cgroup */
+    void countCgroup () {
+        if (trace.pdu_len != 0) return;
 
-            case __BLK_TA_ISSUE:
-                tC[DISPATCH]++;
+        COUNT & tC = mCOUNT_CG[cgroup];
+        if (tC.empty ()) tC.resize (LAST_ELEMENT, 0);
+        tally (tC);
+    }
 
-                if(m) {
-                    if(w) tC[WRITEMETA]++;
-                    else tC[READMETA]++;
-                }
-                else if (s) {
-                    if (w) tC[DWRITESYNC]++;    // Writes/READS on I
-                    else tC[DREADSYNC]++;
-                }
-                else if (w) tC[DWRITE]++;
-                else tC[DREAD]++;  // Writes/READS on I
+    /* Adds the trace line to the counts */
+    void tally (COUNT & tC) {
+        // ISSUE
+        int action = trace.action & 0xffff;
+        int w = trace.action & BLK_TC_ACT(BLK_TC_WRITE);
+        int a = trace.action & BLK_TC_ACT(BLK_TC_AHEAD);
+        int s = trace.action & BLK_TC_ACT(BLK_TC_SYNC);
+        int m = trace.action & BLK_TC_ACT(BLK_TC_META);
+        int d = trace.action & BLK_TC_ACT(BLK_TC_DISCARD);
+        int f = trace.action & BLK_TC_ACT(BLK_TC_FLUSH);
+        int u = trace.action & BLK_TC_ACT(BLK_TC_FUA);
 
-                break;
+        switch (action) {
+        case __BLK_TA_COMPLETE:
+            tC[COMPLETE]++;
+            
 
-            case __BLK_TA_INSERT:
-                tC[ISSUE]++;
+            if (s) {
+                if (w) tC[CWRITESYNC]++;    // Writes/READS on I
+                else tC[CREADSYNC]++;
+            }
+            else if (w) tC[CWRITE]++;
+            else tC[CREAD]++;  // Writes/READS on I
 
-                if (s) {
-                    if (w) tC[WRITESYNC]++;    // Writes/READS on I
-                    else tC[READSYNC]++;
-                }
-                else if (w) tC[WRITE]++;
-                else tC[READ]++;  // Writes/READS on I
+            break;
 
-                break;
+        case __BLK_TA_ISSUE:
+            tC[DISPATCH]++;
+
+            if(m) {
+                if(w) tC[WRITEMETA]++;
+                else tC[READMETA]++;
+            }
+            else if (s) {
+                if (w) tC[DWRITESYNC]++;    // Writes/READS on I
+                else tC[DREADSYNC]++;
+            }
+            else if (w) tC[DWRITE]++;
+            else tC[DREAD]++;  // Writes/READS on I
+
+            break;
+
+        case __BLK_TA_INSERT:
+            tC[ISSUE]++;
+
+            if (s) {
+                if (w) tC[WRITESYNC]++;    // Writes/READS on I
+                else tC[READSYNC]++;
+            }
+            else if (w) tC[WRITE]++;
+            else tC[READ]++;  // Writes/READS on I
+
+            break;
+
+        case __BLK_TA_BACKMERGE :
+            tC[MERGE]++;
+            tC[BACKMERGE]++;
+            break;
+
+        case __BLK_TA_FRONTMERGE :
+            tC[MERGE]++;
+            tC[FRONTMERGE]++;
+            break;
+
+         case __BLK_TA_QUEUE:
+            if (a) tC[RA]++;
+            if (f) tC[FLUSH]++;
+            if (u) tC[FUA]++;
+            if (d) tC[DISCARD]++;
+            break;   
+        }
+    }
+
+    /* Fills request size and merged bytes data, per pid (dispatches per queuer) */
+    void measure () {
+        if (trace.pdu_len != 0) return;
+
+        measure (mSIZES[queuer]);
+    }
+
+    /* Same, per cgroup */
+    void measureCgroup () {
+        if (trace.pdu_len != 0) return;
+
+        measure (mSIZES_CG[cgroup]);
+    }
+
+    void measure (sizes & z) {
+        bool w = trace.action & BLK_TC_ACT(BLK_TC_WRITE);
+
+        switch (trace.action & 0xffff) {
+        case __BLK_TA_QUEUE:
+            z.add (SQUEUE, w, trace.bytes);
+            break;
+
+        case __BLK_TA_INSERT:
+            z.add (SINSERT, w, trace.bytes);
+            break;
+
+        case __BLK_TA_ISSUE:
+            z.add (SDISPATCH, w, trace.bytes);
+            break;
+
+        case __BLK_TA_BACKMERGE:
+            z.backBytes += trace.bytes;
+            break;
+
+        case __BLK_TA_FRONTMERGE:
+            z.frontBytes += trace.bytes;
+            break;
+        }
+    }
+
+    /* ORDERING bits of the trace line */
+    unsigned int kinds () const {
+        return ((trace.action & BLK_TC_ACT(BLK_TC_FLUSH)) ? 1 << OFLUSH : 0) |
+               ((trace.action & BLK_TC_ACT(BLK_TC_FUA)) ? 1 << OFUA : 0) |
+               ((trace.action & BLK_TC_ACT(BLK_TC_DISCARD)) ? 1 << ODISCARD : 0);
+    }
+
+    /* Adds the latencies of a completed request */
+    void complete (const pending & p) {
+        mLATENCY_CG[p.cgroup].add (p, trace.time);
+        for (int k = 0; k < LAST_ORDERING; k++)
+            if (p.kinds & (1 << k)) {
+                ordering & o = mORDERING[p.pid];
+                o.completed[k]++;
+                o.latency[k] += trace.time - p.queued;
+                o.latencyMax[k] = max (o.latencyMax[k], trace.time - p.queued);
+            }
+    }
+
+    /*
+       Follows the requests from queue to completion. Latencies go to the
+       cgroup that queued them and, for flush, FUA and discard, to the pid
+       that queued them. Also follows the ordering stalls of the device.
+     */
+    void time () {
+        if (trace.pdu_len != 0) return;
 
-            case __BLK_TA_BACKMERGE :
-                tC[MERGE]++;
+        DEVSECTOR key (trace.device, trace.sector);
+        stalls & st = mSTALLS[trace.device];
+
+        st.expire (trace.time);
+
+        switch (trace.action & 0xffff) {
+        case __BLK_TA_QUEUE: {
+            pending p = pending {trace.time, 0, cgroup, (int) trace.pid, kinds ()};
+
+            for (int k = 0; k < LAST_ORDERING; k++)
+                if (p.kinds & (1 << k)) mORDERING[trace.pid].bytes[k] += trace.bytes;
+
+            if (p.kinds & ORDERED) {
+                st.acquire (p);
                 break;
+            }
+
+            mPENDING[key] = p;
+            if (not st.inflight.empty ()) {
+                st.queued++;
+                st.waiting[trace.sector] = make_pair (trace.time, (int) trace.pid);
+            }
+            break;
+        }
+
+        /* Flush and FUA bios are never merged */
+        case __BLK_TA_BACKMERGE:
+            mPENDING.erase (key);
+            st.waiting.erase (trace.sector);
+            break;
+
+        case __BLK_TA_FRONTMERGE: {
+            unsigned long long old = trace.sector + (trace.bytes >> 9);
+            auto W = st.waiting.find (old);
+            if (W != st.waiting.end ()) {
+                auto w = W->second;
+                st.waiting.erase (W);
+                st.waiting[trace.sector] = w;
+            }
+
+            auto R = mPENDING.find (DEVSECTOR (trace.device, old));
+            if (R == mPENDING.end ()) break;
+            pending p = R->second;
+            mPENDING.erase (R);
+            mPENDING[key] = p;
+            break;
+        }
 
-            case __BLK_TA_FRONTMERGE :
-                tC[MERGE]++;
+        case __BLK_TA_ISSUE: {
+            if (kinds () & ORDERED) {
+                auto I = st.match (kinds (), true);
+                if (I != st.inflight.end ()) I->dispatched = trace.time;
                 break;
+            }
+
+            auto R = mPENDING.find (key);
+            if (R != mPENDING.end () and R->second.dispatched == 0) R->second.dispatched = trace.time;
 
-             case __BLK_TA_QUEUE:
-                if (a) tC[RA]++;
-                break;   
+            auto W = st.waiting.find (trace.sector);
+            if (W != st.waiting.end ()) {
+                st.wait (W->second, trace.time);
+                st.waiting.erase (W);
             }
+            break;
         }
+
+        case __BLK_TA_COMPLETE: {
+            if (kinds () & ORDERED) {
+                auto I = st.match (kinds (), false);
+                if (I == st.inflight.end ()) break;
+                complete (*I);
+                st.release (I, trace.time);
+                break;
+            }
+
+            auto R = mPENDING.find (key);
+            if (R == mPENDING.end ()) break;
+            complete (R->second);
+            mPENDING.erase (R);
+            break;
+        }
+        }
+    }
+
+    /* Follows the queuer of the requests until they are dispatched, must go before measure () and locate () */
+    void follow () {
+        if (trace.pdu_len != 0) return;
+
+        queuer = followQueuer (mQUEUER, trace.action, trace.pid, trace.device, trace.sector, trace.bytes);
+    }
+
+    int chargedPid () const {
+        return queuer;
+    }
+
+    /* Fills seek, size and heat map data of the dispatched requests, empty flushes have no location */
+    void locate () {
+        if (trace.pdu_len != 0 or (trace.action & 0xffff) != __BLK_TA_ISSUE or trace.bytes == 0) return;
+
+        mLOCALITY_DEV[trace.device].add (trace.sector, trace.bytes);
+        mLOCALITY_PID[PIDDEV (queuer, trace.device)].add (trace.sector, trace.bytes);
+
+        auto H = mHEAT.find (trace.device);
+        if (H == mHEAT.end ()) {
+            H = mHEAT.insert (make_pair (trace.device, heatMap ())).first;
+            H->second.startTime = trace.time;
+        }
+        H->second.add (trace.time, trace.sector);
     }
 };
 
-/* Output WIKI formatted stats */
-void printWIKI (const map <int, COUNT> & mC, bool compact)
+/*
+   Counting kernel of the cached traces. The COUNT slots a std record adds
+   to only depend on its action code and category bits, so they are looked
+   up as a bit mask in a table indexed by them. The table is filled running
+   tally () on every combination, so both ways always count the same.
+ */
+const int KERNEL_INDEXES = 16 << 7;  /* action codes 0-15, 7 category bits */
+__u32 slotTable[KERNEL_INDEXES];
+
+static_assert (LAST_ELEMENT <= 32, "COUNT slots must fit the kernel masks");
+
+/* Category bits used by tally (), in kernel index order */
+const __u32 KERNEL_CATEGORIES[7] = { BLK_TC_WRITE, BLK_TC_FLUSH, BLK_TC_SYNC, BLK_TC_AHEAD,
+                                     BLK_TC_META, BLK_TC_DISCARD, BLK_TC_FUA
+                                   };
+
+void buildSlotTable ()
+{
+    for (int i = 0; i < KERNEL_INDEXES; i++) {
+        blk_io_trace trace;
+        memset (&trace, 0, sizeof (trace));
+        trace.action = i >> 7;
+        for (int b = 0; b < 7; b++)
+            if (i & (1 << b)) trace.action |= BLK_TC_ACT(KERNEL_CATEGORIES[b]);
+
+        COUNT c (LAST_ELEMENT, 0);
+        traceLine (trace, "").tally (c);
+
+        slotTable[i] = 0;
+        for (int e = 0; e < LAST_ELEMENT; e++)
+            if (c[e]) slotTable[i] |= 1U << e;
+    }
+}
+
+inline unsigned int kernelIndex (__u32 action)
+{
+    __u32 code = action & 0xffff;
+    unsigned int index = code < 16 ? code << 7 : 0;
+    for (int b = 0; b < 7; b++)
+        if (action & BLK_TC_ACT(KERNEL_CATEGORIES[b])) index |= 1 << b;
+    return index;
+}
+
+/* Slot masks of n records, 0 for the records with a payload */
+void classifyScalar (const __u32 * action, const __u16 * pdu_len, size_t n, __u32 * mask)
+{
+    for (size_t i = 0; i < n; i++)
+        mask[i] = pdu_len[i] ? 0 : slotTable[kernelIndex (action[i])];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Same, 8 records at a time with a gather from the table */
+__attribute__ ((target ("avx2")))
+void classifyAVX2 (const __u32 * action, const __u16 * pdu_len, size_t n, __u32 * mask)
+{
+    const __m256i low = _mm256_set1_epi32 (0xffff);
+    const __m256i codes = _mm256_set1_epi32 (16);
+    const __m256i one = _mm256_set1_epi32 (1);
+    const __m256i zero = _mm256_setzero_si256 ();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *) (action + i));
+        __m256i code = _mm256_and_si256 (a, low);
+        code = _mm256_and_si256 (code, _mm256_cmpgt_epi32 (codes, code));
+        __m256i index = _mm256_slli_epi32 (code, 7);
+
+        for (int b = 0; b < 7; b++) {
+            __m256i bit = _mm256_and_si256 (_mm256_srli_epi32 (a, __builtin_ctz (BLK_TC_ACT(KERNEL_CATEGORIES[b]))), one);
+            index = _mm256_or_si256 (index, _mm256_slli_epi32 (bit, b));
+        }
+
+        __m256i m = _mm256_i32gather_epi32 ((const int *) slotTable, index, 4);
+        __m256i len = _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *) (pdu_len + i)));
+        m = _mm256_and_si256 (m, _mm256_cmpeq_epi32 (len, zero));
+        _mm256_storeu_si256 ((__m256i *) (mask + i), m);
+    }
+
+    classifyScalar (action + i, pdu_len + i, n - i, mask + i);
+}
+#endif
+
+/*
+   Counts the cached records per pid, as count () does. Records are
+   classified in blocks by the kernel of the cpu, then added to the
+   COUNT of their pid.
+ */
+void countCache (const traceCache & cache, map < int, COUNT > &mC)
+{
+    const size_t BLOCK = 1 << 16;
+    vector < __u32 > mask (BLOCK);
+    void (*classify) (const __u32 *, const __u16 *, size_t, __u32 *) = classifyScalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports ("avx2")) classify = classifyAVX2;
+#endif
+
+    buildSlotTable ();
+
+    int lastPid = 0;
+    COUNT * tC = NULL;
+
+    for (__u64 first = 0; first < cache.records; first += BLOCK) {
+        size_t n = min ((__u64) BLOCK, cache.records - first);
+        classify (cache.action + first, cache.pdu_len + first, n, mask.data ());
+
+        for (size_t i = 0; i < n; i++) {
+            int pid = cache.pid[first + i];
+            if (tC == NULL or pid != lastPid) {
+                lastPid = pid;
+                auto I = mC.find (pid);
+                if (I == mC.end ()) { /* The first record of a pid is not counted, as in count () */
+                    tC = &(mC[pid] = COUNT (LAST_ELEMENT, 0));
+                    continue;
+                }
+                tC = &I->second;
+            }
+
+            for (__u32 m = mask[i]; m; m &= m - 1) (*tC)[__builtin_ctz (m)]++;
+        }
+    }
+}
+
+/*
+   Queued and dispatched requests and bytes per pid of the cached records,
+   all the amplification column needs, straight from the action, pid,
+   device, sector, bytes and pdu_len columns. The dispatches are charged to
+   their queuer as measure () does. The size histograms (-s) are filled by
+   measure ().
+ */
+void measureCache (const traceCache & cache)
+{
+    QUEUERS queuers;
+    int lastPid = 0;
+    sizes * z = NULL;
+
+    for (__u64 i = 0; i < cache.records; i++) {
+        __u32 code = cache.action[i] & 0xffff;
+        if (cache.pdu_len[i] or (code != __BLK_TA_QUEUE and code != __BLK_TA_ISSUE and
+                                 code != __BLK_TA_BACKMERGE and code != __BLK_TA_FRONTMERGE)) continue;
+
+        int pid = followQueuer (queuers, cache.action[i], cache.pid[i], cache.device[i], cache.sector[i], cache.bytes[i]);
+        if ((code != __BLK_TA_QUEUE and code != __BLK_TA_ISSUE) or cache.bytes[i] == 0) continue;
+
+        if (z == NULL or pid != lastPid) {
+            lastPid = pid;
+            z = &mSIZES[pid];
+        }
+
+        int stage = code == __BLK_TA_QUEUE ? SQUEUE : SDISPATCH;
+        z->requests[stage]++;
+        z->bytes[stage] += cache.bytes[i];
+    }
+}
+
+/* Output WIKI formatted stats, the rows are processes (pid) or cgroups (id),
+   named by name and with the amplification given by ampl
+ */
+template < class KEY >
+void printWIKI (const map <KEY, COUNT> & mC, bool compact, const string & title, const string & id,
+                string (*name) (KEY), string (*ampl) (KEY))
 {
     if (compact)
         cout << "{|border=\"1\"" << endl <<
-             "!Process||PID||RM||WM||R||RS||W||WS||RA||M||I||D||C" << endl <<
+             "!" << title << "||" << id << "||RM||WM||R||RS||W||WS||RA||M||I||D||C||A" << endl <<
              "|- align=\"right\" " << endl;
     else
         cout << "{|border=\"1\"" << endl <<
-             "!Process||PID||RM||WM||IR||IRS||DR||DRS||CR||CRS||IW||IWS||DW||DWS||CW||CWS||RA||M||I||D||C" << endl <<
+             "!" << title << "||" << id << "||RM||WM||IR||IRS||DR||DRS||CR||CRS||IW||IWS||DW||DWS||CW||CWS||RA||M||I||D||C||A" << endl <<
              "|- align=\"right\" " << endl;
 
     for (auto I  : mC) {
         const COUNT c = I.second;
         string s = "||";
         if (compact) s = "/";
-            cout << "|" << pid2name[I.first] << "||" << I.first << "||";
+            cout << "|" << name (I.first) << "||" << I.first << "||";
             cout << c[READMETA] << "||" <<c[WRITEMETA] << "||";
             cout << c[READ] << s << c[DREAD] << s << c[CREAD] << "||" << c[READSYNC] << s << c[DREADSYNC] << s << c[CREADSYNC] << "||";
             cout << c[WRITE] << s << c[DWRITE] << s << c[CWRITE] << "||" << c[WRITESYNC] << s << c[DWRITESYNC] << s << c[CWRITESYNC] << "||";
             cout << c[RA] << "||" << c[MERGE] << "||" ;
-            cout << c[ISSUE] << "||" << c[DISPATCH] << "||" << c[COMPLETE]  << endl <<
+            cout << c[ISSUE] << "||" << c[DISPATCH] << "||" << c[COMPLETE] << "||" << ampl (I.first) << endl <<
                  "|- align=\"right\"" << endl;
     }
 
@@ -211,11 +1034,13 @@ string format(unsigned int value, int W)
 
     return output;
 }
-/* Output TABBED formatted stats */
-void printTABBED (const map <int, COUNT> & mC, bool compact, int WIDTH)
+/* Output TABBED formatted stats, with the same rows as printWIKI */
+template < class KEY >
+void printTABBED (const map <KEY, COUNT> & mC, bool compact, int WIDTH, const string & title, const string & id,
+                  string (*name) (KEY), string (*ampl) (KEY))
 {
     int W = WIDTH;
-    cout << setw (16) << "Process" << setw (W) << "PID" ;
+    cout << setw (16) << title << setw (W) << id ;
     cout << setw(W) << "RMD" << setw(W) << "WMD" ;
 
     if (compact)
@@ -236,11 +1061,11 @@ void printTABBED (const map <int, COUNT> & mC, bool compact, int WIDTH)
     }
 
     cout << setw (W) << "RA" << setw (W) << "M";
-    cout << setw (W) << "I" << setw (W) << "D" << setw (W) << "C" << endl;
+    cout << setw (W) << "I" << setw (W) << "D" << setw (W) << "C" << setw (W) << "A" << endl;
 
     for (auto I  : mC) {
         const COUNT c = I.second;
-        cout << setw (16) << pid2name[I.first] << setw (W) << I.first <<    setw (W) << format(c[READMETA], W) << setw (W) << format(c[WRITEMETA], W);
+        cout << setw (16) << name (I.first) << setw (W) << I.first <<    setw (W) << format(c[READMETA], W) << setw (W) << format(c[WRITEMETA], W);
 
         if (compact) {
             cout << setw (W * 3) << (format(c[READ], W) + "/" + format(c[DREAD], W) + "/" + format(c[CREAD], W));
@@ -265,26 +1090,489 @@ void printTABBED (const map <int, COUNT> & mC, bool compact, int WIDTH)
         cout <<  setw (W) << format(c[RA], W) <<
              setw (W) << format(c[MERGE], W) << setw (W) << format(c[ISSUE], W) <<
              setw (W) << format(c[DISPATCH], W) << setw (W) <<
-             format(c[COMPLETE], W)  << endl;
+             format(c[COMPLETE], W) << setw (W) << ampl (I.first) << endl;
+    }
+}
+
+string histogram (const HISTO & h)
+{
+    ostringstream output;
+
+    for (int i = 0; i < HISTO_BUCKETS; i++)
+        if (h[i]) output << " " << bucketLow (i) << ":" << h[i];
+
+    return output.str ();
+}
+
+/* Average of n durations of ns nanoseconds in total, as us with one decimal */
+string us (unsigned long long ns, unsigned long long n)
+{
+    ostringstream output;
+
+    output << fixed << setprecision (1) << (n ? ns / 1000.0 / n : 0.0);
+    return output.str ();
+}
+
+/*
+   Output flush, FUA and discard requests per pid: number, bytes, average
+   and maximum queue to complete latency (us), and the normal requests that
+   waited behind a flush or FUA. Then the ordering stalls per device.
+ */
+void printORDERING (bool wiki)
+{
+    const char * kind[LAST_ORDERING] = { "F", "FUA", "DC" };
+    const EVENTS event[LAST_ORDERING] = { FLUSH, FUA, DISCARD };
+
+    if (wiki) {
+        cout << "{|border=\"1\"" << endl << "!Process||PID";
+        for (int k = 0; k < LAST_ORDERING; k++)
+            cout << "||" << kind[k] << "||" << kind[k] << "B||" << kind[k] << " avg||" << kind[k] << " max";
+        cout << "||Stalled||Waited" << endl << "|- align=\"right\" " << endl;
+    }
+    else {
+        cout << endl << setw (16) << "Process" << setw (8) << "PID";
+        for (int k = 0; k < LAST_ORDERING; k++)
+            cout << setw (8) << kind[k] << setw (12) << (string (kind[k]) + "B") << setw (10) << (string (kind[k]) + " avg") <<
+                 setw (10) << (string (kind[k]) + " max");
+        cout << setw (10) << "Stalled" << setw (12) << "Waited" << endl;
+    }
+
+    for (auto & I : mORDERING) {
+        const ordering & o = I.second;
+        auto C = mCOUNT.find (I.first);
+
+        if (wiki) cout << "|" << pid2name[I.first] << "||" << I.first;
+        else cout << setw (16) << pid2name[I.first] << setw (8) << I.first;
+
+        for (int k = 0; k < LAST_ORDERING; k++) {
+            unsigned int n = C == mCOUNT.end () ? 0 : C->second[event[k]];
+            if (wiki)
+                cout << "||" << n << "||" << o.bytes[k] << "||" << us (o.latency[k], o.completed[k]) << "||" <<
+                     us (o.latencyMax[k], 1);
+            else
+                cout << setw (8) << n << setw (12) << o.bytes[k] << setw (10) << us (o.latency[k], o.completed[k]) <<
+                     setw (10) << us (o.latencyMax[k], 1);
+        }
+
+        if (wiki) cout << "||" << o.stalled << "||" << us (o.waited, 1) << endl << "|- align=\"right\"" << endl;
+        else cout << setw (10) << o.stalled << setw (12) << us (o.waited, 1) << endl;
+    }
+
+    if (wiki)
+        cout << "}" << endl << "{|border=\"1\"" << endl <<
+             "!Device||Stalls||Time||Max||Queued||Waited" << endl << "|- align=\"right\" " << endl;
+    else
+        cout << endl << setw (16) << "Device" << setw (10) << "Stalls" << setw (14) << "Time" << setw (12) << "Max" <<
+             setw (10) << "Queued" << setw (14) << "Waited" << endl;
+
+    for (auto & I : mSTALLS) {
+        const stalls & st = I.second;
+        if (wiki)
+            cout << "|" << devName (I.first) << "||" << st.windows << "||" << us (st.duration, 1) << "||" <<
+                 us (st.durationMax, 1) << "||" << st.queued << "||" << us (st.waited, 1) << endl <<
+                 "|- align=\"right\"" << endl;
+        else
+            cout << setw (16) << devName (I.first) << setw (10) << st.windows << setw (14) << us (st.duration, 1) <<
+                 setw (12) << us (st.durationMax, 1) << setw (10) << st.queued << setw (14) << us (st.waited, 1) << endl;
+    }
+
+    if (wiki) cout << "}" << endl;
+}
+
+/* Output the queue to complete and dispatch to complete latencies per cgroup, in us */
+void printLATENCY (bool wiki)
+{
+    if (wiki)
+        cout << "{|border=\"1\"" << endl <<
+             "!Cgroup||Id||Q2C||Q2C avg||Q2C max||D2C||D2C avg||D2C max" << endl <<
+             "|- align=\"right\" " << endl;
+    else
+        cout << endl << setw (16) << "Cgroup" << setw (12) << "Id" << setw (10) << "Q2C" << setw (12) << "Q2C avg" <<
+             setw (12) << "Q2C max" << setw (10) << "D2C" << setw (12) << "D2C avg" << setw (12) << "D2C max" << endl;
+
+    for (auto & I : mLATENCY_CG) {
+        const latency & l = I.second;
+        if (wiki)
+            cout << "|" << cgroupName (I.first) << "||" << I.first << "||" << l.requests << "||" << us (l.q2c, l.requests) <<
+                 "||" << us (l.q2cMax, 1) << "||" << l.dispatched << "||" << us (l.d2c, l.dispatched) << "||" <<
+                 us (l.d2cMax, 1) << endl << "|- align=\"right\"" << endl;
+        else
+            cout << setw (16) << cgroupName (I.first) << setw (12) << I.first << setw (10) << l.requests <<
+                 setw (12) << us (l.q2c, l.requests) << setw (12) << us (l.q2cMax, 1) << setw (10) << l.dispatched <<
+                 setw (12) << us (l.d2c, l.dispatched) << setw (12) << us (l.d2cMax, 1) << endl;
+    }
+
+    if (wiki) cout << "}" << endl;
+}
+
+/* Output request size histograms and merged bytes per pid */
+void printSIZES (bool wiki)
+{
+    const char * stage[LAST_STAGE] = { "Q", "I", "D" };
+    const char * op[2] = { "R", "W" };
+
+    if (wiki)
+        cout << "{|border=\"1\"" << endl <<
+             "!Process||PID||Size (bytes)||FM||FMB||BM||BMB||A" << endl <<
+             "|- align=\"right\" " << endl;
+    else
+        cout << endl << setw (16) << "Process" << setw (8) << "PID" << setw (8) << "FM" << setw (12) << "FMB" <<
+             setw (8) << "BM" << setw (12) << "BMB" << setw (8) << "A" << "  Size (bytes), bucket:count" << endl;
+
+    for (auto & I : mSIZES) {
+        const sizes & z = I.second;
+        const COUNT & c = mCOUNT[I.first];
+        unsigned int fm = c.empty () ? 0 : c[FRONTMERGE];
+        unsigned int bm = c.empty () ? 0 : c[BACKMERGE];
+
+        if (wiki) {
+            cout << "|" << pid2name[I.first] << "||" << I.first << "||";
+            for (int s = 0; s < LAST_STAGE; s++)
+                for (int w = 0; w < 2; w++)
+                    if (z.histo[s][w] != HISTO (HISTO_BUCKETS, 0)) cout << stage[s] << op[w] << histogram (z.histo[s][w]) << " ";
+            cout << "||" << fm << "||" << z.frontBytes << "||" << bm << "||" << z.backBytes << "||" <<
+                 z.amplification () << endl << "|- align=\"right\"" << endl;
+        }
+        else {
+            cout << setw (16) << pid2name[I.first] << setw (8) << I.first << setw (8) << fm << setw (12) << z.frontBytes <<
+                 setw (8) << bm << setw (12) << z.backBytes << setw (8) << z.amplification () << endl;
+            for (int s = 0; s < LAST_STAGE; s++)
+                for (int w = 0; w < 2; w++)
+                    if (z.histo[s][w] != HISTO (HISTO_BUCKETS, 0))
+                        cout << setw (74) << (string (stage[s]) + op[w]) << histogram (z.histo[s][w]) << endl;
+        }
+    }
+
+    if (wiki) cout << "}" << endl;
+}
+
+/* Output locality stats, per device and per pid on each device */
+void printLOCALITY (bool wiki)
+{
+    if (wiki)
+        cout << "{|border=\"1\"" << endl <<
+             "!Process||PID||Device||D||Seq%||Seek (sectors)||Size (bytes)" << endl <<
+             "|- align=\"right\" " << endl;
+    else
+        cout << endl << setw (16) << "Process" << setw (8) << "PID" << setw (8) << "Device" <<
+             setw (10) << "D" << setw (8) << "Seq%" << "  Seek (sectors) / Size (bytes), bucket:count" << endl;
+
+    auto line = [wiki] (const string & name, const string & pid, unsigned int device, const locality & l) {
+        if (wiki)
+            cout << "|" << name << "||" << pid << "||" << devName (device) << "||" << l.dispatches << "||" <<
+                 fixed << setprecision (1) << l.sequentialPct () << "||" << histogram (l.seek) << "||" <<
+                 histogram (l.size) << endl << "|- align=\"right\"" << endl;
+        else
+            cout << setw (16) << name << setw (8) << pid << setw (8) << devName (device) <<
+                 setw (10) << l.dispatches << setw (8) << fixed << setprecision (1) << l.sequentialPct () << endl <<
+                 setw (50) << "seek" << histogram (l.seek) << endl <<
+                 setw (50) << "size" << histogram (l.size) << endl;
+    };
+
+    for (auto & I : mLOCALITY_DEV) line ("All", "-", I.first, I.second);
+    for (auto & I : mLOCALITY_PID) line (pid2name[I.first.first], to_string (I.first.first), I.first.second, I.second);
+
+    if (wiki) cout << "}" << endl;
+}
+
+/*
+   Exports the heat map as CSV (one line per non empty cell) and as a paraver
+   trace with a task per device and a thread per LBA bucket, the event value
+   being the number of dispatches of the bucket during the time bin.
+ */
+void exportHEAT (const string & prefix)
+{
+    const unsigned int HEATEVENT = 200000;
+
+    ofstream CSV (prefix + ".heat.csv");
+    CSV << "major,minor,time_begin,time_end,sector_begin,sector_end,dispatches" << endl;
+
+    for (auto & I : mHEAT) {
+        heatMap & h = I.second;
+        for (int i = 0; i < HEAT_TIME_BINS; i++)
+            for (int b = 0; b < HEAT_LBA_BUCKETS; b++)
+                if (h.cell (i, b))
+                    CSV << (I.first >> 20) << "," << (I.first & 0xfffff) << "," << h.startTime + i * h.binWidth << "," <<
+                        h.startTime + (i + 1) * h.binWidth << "," << b * h.bucketWidth << "," <<
+                        (b + 1) * h.bucketWidth << "," << h.cell (i, b) << endl;
+    }
+    CSV.close ();
+
+    /* Paraver needs the records sorted by time, devices may use different bin widths */
+    map < unsigned long long, vector < string > > records;
+    unsigned long long endTime = 0;
+    int task = 1;
+
+    for (auto & I : mHEAT) {
+        heatMap & h = I.second;
+        for (int b = 0; b < HEAT_LBA_BUCKETS; b++) {
+            unsigned long long last = 0;
+            for (int i = 0; i < HEAT_TIME_BINS; i++) {
+                if (h.cell (i, b) == last) continue;
+                last = h.cell (i, b);
+                unsigned long long t = h.startTime + i * h.binWidth;
+                records[t].push_back ("2:1:1:" + to_string (task) + ":" + to_string (b + 1) + ":" +
+                                      to_string (t) + ":" + to_string (HEATEVENT) + ":" + to_string (last));
+            }
+        }
+        endTime = max (endTime, h.startTime + HEAT_TIME_BINS * h.binWidth);
+        task++;
+    }
+
+    ofstream PRV (prefix + ".heat.prv");
+    PRV << "#Paraver (06/08/14 at 23:30):" << endTime << ":1(1):1:" << mHEAT.size () << "(";
+    for (unsigned int i = 0; i < mHEAT.size (); i++)
+        PRV << (i ? "," : "") << HEAT_LBA_BUCKETS << ":1";
+    PRV << ")" << endl;
+
+    for (auto & R : records)
+        for (auto & line : R.second) PRV << line << endl;
+    PRV.close ();
+
+    ofstream PCF (prefix + ".heat.pcf");
+    PCF << "DEFAULT_SEMANTIC" << endl;
+    PCF << "THREAD_FUNC          Last Evt Val" << endl;
+    PCF << "EVENT_TYPE" << endl;
+    PCF << "0  " << HEATEVENT << "  Dispatches in LBA bucket" << endl;
+    PCF.close ();
+
+    ofstream ROW (prefix + ".heat.row");
+    ROW << "LEVEL TASK SIZE " << mHEAT.size () << endl;
+    for (auto & I : mHEAT) ROW << "Device " << devName (I.first) << endl;
+    ROW << "LEVEL THREAD SIZE " << mHEAT.size () * HEAT_LBA_BUCKETS << endl;
+    for (auto & I : mHEAT)
+        for (int b = 0; b < HEAT_LBA_BUCKETS; b++)
+            ROW << devName (I.first) << " LBA " << b * I.second.bucketWidth << endl;
+    ROW.close ();
+}
+
+/*
+   Checkpoint: input offset and all the state gathered so far, so that a
+   later run on the same (growing) trace only processes the new records.
+ */
+bool loadCheckpoint (const string & filename, const string & input, unsigned long long & offset)
+{
+    ifstream in;
+    if (not openCheckpoint (in, filename, "blktrace2stats")) return false;
+
+    if (loadString (in) != input) {
+        cerr << "The checkpoint " << filename << " belongs to another input file" << endl;
+        exit(-1);
+    }
+    in >> offset;
+
+    size_t n;
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        int pid;
+        in >> pid;
+        pid2name[pid] = loadString (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        int pid;
+        in >> pid;
+        loadSparse (in, mCOUNT[pid]);
+        mCOUNT[pid].resize (LAST_ELEMENT, 0);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        int pid;
+        in >> pid;
+        mSIZES[pid].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned int device;
+        in >> device;
+        mLOCALITY_DEV[device].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        PIDDEV key;
+        in >> key.first >> key.second;
+        mLOCALITY_PID[key].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned int device;
+        in >> device;
+        mHEAT[device].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        DEVSECTOR key;
+        in >> key.first >> key.second;
+        in >> mQUEUER[key];
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long cgroup;
+        in >> cgroup;
+        loadSparse (in, mCOUNT_CG[cgroup]);
+        mCOUNT_CG[cgroup].resize (LAST_ELEMENT, 0);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long cgroup;
+        in >> cgroup;
+        mSIZES_CG[cgroup].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long cgroup;
+        in >> cgroup;
+        mLATENCY_CG[cgroup].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        DEVSECTOR key;
+        pending p;
+        in >> key.first >> key.second >> p.queued >> p.dispatched >> p.cgroup >> p.pid >> p.kinds;
+        mPENDING[key] = p;
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        int pid;
+        in >> pid;
+        mORDERING[pid].load (in);
+    }
+
+    in >> n;
+    for (size_t i = 0; i < n; i++) {
+        unsigned int device;
+        in >> device;
+        mSTALLS[device].load (in);
+    }
+
+    if (in.fail ()) {
+        cerr << "The checkpoint " << filename << " is corrupted" << endl;
+        exit(-1);
+    }
+    return true;
+}
+
+void saveCheckpoint (const string & filename, const string & input, unsigned long long offset)
+{
+    ofstream out;
+    createCheckpoint (out, filename, "blktrace2stats");
+
+    saveString (out, input);
+    out << offset << "\n";
+
+    out << pid2name.size () << "\n";
+    for (auto & I : pid2name) {
+        out << I.first << " ";
+        saveString (out, I.second);
+        out << "\n";
+    }
+
+    out << mCOUNT.size () << "\n";
+    for (auto & I : mCOUNT) {
+        out << I.first << " ";
+        saveSparse (out, I.second);
+    }
+
+    out << mSIZES.size () << "\n";
+    for (auto & I : mSIZES) {
+        out << I.first << "\n";
+        I.second.save (out);
+    }
+
+    out << mLOCALITY_DEV.size () << "\n";
+    for (auto & I : mLOCALITY_DEV) {
+        out << I.first << "\n";
+        I.second.save (out);
+    }
+
+    out << mLOCALITY_PID.size () << "\n";
+    for (auto & I : mLOCALITY_PID) {
+        out << I.first.first << " " << I.first.second << "\n";
+        I.second.save (out);
+    }
+
+    out << mHEAT.size () << "\n";
+    for (auto & I : mHEAT) {
+        out << I.first << "\n";
+        I.second.save (out);
+    }
+
+    out << mQUEUER.size () << "\n";
+    for (auto & I : mQUEUER) out << I.first.first << " " << I.first.second << " " << I.second << "\n";
+
+    out << mCOUNT_CG.size () << "\n";
+    for (auto & I : mCOUNT_CG) {
+        out << I.first << " ";
+        saveSparse (out, I.second);
+    }
+
+    out << mSIZES_CG.size () << "\n";
+    for (auto & I : mSIZES_CG) {
+        out << I.first << "\n";
+        I.second.save (out);
     }
+
+    out << mLATENCY_CG.size () << "\n";
+    for (auto & I : mLATENCY_CG) {
+        out << I.first << " ";
+        I.second.save (out);
+    }
+
+    out << mPENDING.size () << "\n";
+    for (auto & I : mPENDING)
+        out << I.first.first << " " << I.first.second << " " << I.second.queued << " " <<
+            I.second.dispatched << " " << I.second.cgroup << " " << I.second.pid << " " << I.second.kinds << "\n";
+
+    out << mORDERING.size () << "\n";
+    for (auto & I : mORDERING) {
+        out << I.first << " ";
+        I.second.save (out);
+    }
+
+    out << mSTALLS.size () << "\n";
+    for (auto & I : mSTALLS) {
+        out << I.first << " ";
+        I.second.save (out);
+    }
+
+    if (not commitCheckpoint (out, filename))
+        cerr << "We have some problem writing the checkpoint " << filename << endl;
 }
 
 int main (int argc, char **argv)
 {
     bool WIKI = false;
     bool COMPACT = false;
+    bool LOCALITY = false;
+    bool SIZES = false;
+    bool CGROUPS = false;
+    bool ORDERING = false;
     int WIDTH = 5;
     string filename;
+    string heatname;
+    string checkpoint;
+    string cachename;
 
     if (argc < 2)  {
-        cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2stats -i <inputbinarytrace> -w (wiki output) -c (compact output) -W <width>" << endl;
+        cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2stats -i <inputbinarytrace> -w (wiki output) -c (compact output) -W <width> -l (locality) -s (sizes) -H <heatmap prefix> -k <checkpoint> -g (cgroups) -G <cgroup names> -C <cache> -f (flush, FUA and discard)" << endl;
         exit(-1);
     }
 
     int opterr = 0;
     int c;
 
-    while ((c = getopt (argc, argv, "i:wcW:")) != -1)
+    while ((c = getopt (argc, argv, "i:wcW:lsH:k:gG:C:f")) != -1)
         switch (c) {
         case 'i':
             filename = optarg;
@@ -302,10 +1590,46 @@ int main (int argc, char **argv)
             COMPACT = true;
             break;
 
+        case 'l':
+            LOCALITY = true;
+            break;
+
+        case 's':
+            SIZES = true;
+            break;
+
+        case 'H':
+            heatname = optarg;
+            break;
+
+        case 'k':
+            checkpoint = optarg;
+            break;
+
+        case 'g':
+            CGROUPS = true;
+            break;
+
+        case 'C':
+            cachename = optarg;
+            break;
+
+        case 'f':
+            ORDERING = true;
+            break;
+
+        case 'G':
+            CGROUPS = true;
+            if (not loadCgroupNames (optarg, cgroup2name)) {
+                cerr << "We have some problem with the cgroup names file, check " << endl;
+                exit(-1);
+            }
+            break;
+
         case '?':
-            cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2stats -i <inputbinarytrace> -w (wiki output) -c (compact output)]" << endl;
+            cerr << "Ramon Nou @ Barcelona Supercomputing Center" << endl << "Usage: blktrace2stats -i <inputbinarytrace> -w (wiki output) -c (compact output) -W <width> -l (locality) -s (sizes) -H <heatmap prefix> -k <checkpoint> -g (cgroups) -G <cgroup names> -C <cache> -f (flush, FUA and discard)]" << endl;
 
-            if (optopt == 'i')
+            if (optopt == 'i' or optopt == 'W' or optopt == 'H' or optopt == 'k' or optopt == 'G' or optopt == 'C')
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -321,24 +1645,100 @@ int main (int argc, char **argv)
         }
 
     string linea;
-    ifstream ifs;
-    ifs.open (filename.c_str(), std::ifstream::binary);
+    traceReader ifs;
+    unsigned long long offset = 0;
 
-    if (!(ifs.is_open() and ifs.good())) {
-        cerr << "We have some problem with the input file, check " << endl;
-        exit(-1);
+    bool HEAT = not heatname.empty ();
+
+    if (not cachename.empty ()) {
+        if (not checkpoint.empty ()) {
+            cerr << "A cache and a checkpoint can not be used together" << endl;
+            exit(-1);
+        }
+
+        traceCache cache;
+        if (not cache.open (cachename, filename) and
+                not (traceCache::build (filename, cachename) and cache.open (cachename, filename))) {
+            cerr << "We have some problem with the input file or the cache, check " << endl;
+            exit(-1);
+        }
+
+        countCache (cache, mCOUNT);
+        if (not SIZES) measureCache (cache);
+
+        /* The other stats follow the records in order, rebuilt from the columns */
+        blk_io_trace trace;
+        const string nopdu;
+        int lastPid = 0;
+        sizes * z = NULL;
+
+        for (__u64 i = 0; (SIZES or LOCALITY or HEAT or CGROUPS or ORDERING) and i < cache.records; i++) {
+            if (cache.pdu_len[i]) continue;
+            cache.row (i, trace);
+            traceLine linea (trace, nopdu, cache.cgroup[i]);
+
+            if (SIZES or LOCALITY or HEAT) linea.follow ();
+            if (SIZES) {
+                if (z == NULL or linea.chargedPid () != lastPid) {
+                    lastPid = linea.chargedPid ();
+                    z = &mSIZES[lastPid];
+                }
+                linea.measure (*z);
+            }
+
+            if ((LOCALITY or HEAT) and (trace.action & 0xffff) == __BLK_TA_ISSUE) linea.locate ();
+            if (CGROUPS) {
+                linea.countCgroup ();
+                linea.measureCgroup ();
+            }
+            if (CGROUPS or ORDERING) linea.time ();
+        }
+
+        for (auto & N : cache.names) pid2name[N.first] = N.second;
     }
+    else {
+        if (not checkpoint.empty ()) loadCheckpoint (checkpoint, filename, offset);
 
-    blk_io_trace trace;
+        if (!ifs.open (filename, offset)) {
+            cerr << "We have some problem with the input file, check " << endl;
+            exit(-1);
+        }
 
-    while ((ifs.is_open () and ifs.good ())) {
-        ifs.read ((char *) &trace, sizeof (blk_io_trace));
-        traceLine linea (trace, ifs);
-        linea.count (mCOUNT);
+        blk_io_trace trace;
+        string pdu;
+        unsigned long long cgroup;
+
+        while (ifs.next (trace, pdu, cgroup)) {
+            traceLine linea (trace, pdu, cgroup);
+            linea.count (mCOUNT);
+            linea.follow ();
+            linea.measure ();
+            if (LOCALITY or HEAT) linea.locate ();
+            if (CGROUPS) {
+                linea.countCgroup ();
+                linea.measureCgroup ();
+            }
+            if (CGROUPS or ORDERING) linea.time ();
+        }
+
+        ifs.close ();
+        ifs.report (filename);
+
+        if (not checkpoint.empty ()) saveCheckpoint (checkpoint, filename, ifs.offset ());
     }
 
-    ifs.close ();
+    if (WIKI) printWIKI(mCOUNT,COMPACT, "Process", "PID", pidName, amplification);
+    else printTABBED(mCOUNT, COMPACT, WIDTH, "Process", "PID", pidName, amplification);
+
+    if (CGROUPS) {
+        cout << endl;
+        if (WIKI) printWIKI (mCOUNT_CG, COMPACT, "Cgroup", "Id", cgroupName, cgroupAmplification);
+        else printTABBED (mCOUNT_CG, COMPACT, WIDTH, "Cgroup", "Id", cgroupName, cgroupAmplification);
+        printLATENCY (WIKI);
+    }
 
-    if (WIKI) printWIKI(mCOUNT,COMPACT);
-    else printTABBED(mCOUNT, COMPACT, WIDTH);
+    if (SIZES) printSIZES (WIKI);
+    if (ORDERING) printORDERING (WIKI);
+    if (LOCALITY) printLOCALITY (WIKI);
+    if (not heatname.empty ()) exportHEAT (heatname);
 }
@@ -0,0 +1,60 @@
+/**
+   cgroups - Cgroup names of the cgroup ids found in the traces
+   Copyright (C) 2014 Ramon Nou at Barcelona Supercomputing Center
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   */
+
+/*
+   Newer kernels tag the records with the id of the cgroup that issued the
+   I/O (the inode number of its directory in the cgroup2 hierarchy). The
+   names file has a "<cgroup id> <name>" line per cgroup, as printed by
+   find /sys/fs/cgroup -type d -printf '%i %P\n'
+ */
+
+#ifndef CGROUPS_H
+#define CGROUPS_H
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+
+/* Loads the names file into names, false if it can not be opened */
+inline bool loadCgroupNames (const std::string & filename, std::map < unsigned long long, std::string > & names)
+{
+    std::ifstream in (filename.c_str ());
+    if (not in.is_open ()) return false;
+
+    std::string line;
+    while (getline (in, line)) {
+        std::istringstream fields (line);
+        unsigned long long id;
+        std::string name;
+        if (line.empty () or line[0] == '#' or not (fields >> id)) continue;
+        getline (fields >> std::ws, name);
+        names[id] = name.empty () ? "/" : name;
+    }
+    return true;
+}
+
+/* Name of a cgroup, its id if it is not in names and "-" for records without a cgroup */
+inline std::string cgroupName (const std::map < unsigned long long, std::string > & names, unsigned long long cgroup)
+{
+    if (cgroup == 0) return "-";
+    auto I = names.find (cgroup);
+    return I == names.end () ? std::to_string (cgroup) : I->second;
+}
+
+#endif
@@ -0,0 +1,104 @@
+/**
+   checkpoint - Helpers to save and load the state of the utilities
+   Copyright (C) 2014 Ramon Nou at Barcelona Supercomputing Center
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   */
+
+/*
+   Checkpoints are text files of whitespace separated values, starting with
+   a line that names the tool that wrote them. Strings are written as
+   <length> <bytes>, so process names may hold spaces, and mostly empty
+   vectors (histograms, heat maps) only hold their non zero values.
+   A checkpoint is written to a temporary file and renamed, so an
+   interrupted run keeps the previous one.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+const int CHECKPOINT_VERSION = 6;
+
+inline void saveString (std::ostream & out, const std::string & s)
+{
+    out << s.size () << " " << s << " ";
+}
+
+inline std::string loadString (std::istream & in)
+{
+    size_t len = 0;
+    in >> len;
+    in.get ();
+
+    std::string s (len, '\0');
+    if (len) in.read (&s[0], len);
+    return s;
+}
+
+template < class T > void saveSparse (std::ostream & out, const std::vector < T > & v)
+{
+    size_t nonzero = 0;
+    for (auto & x : v) if (x) nonzero++;
+
+    out << v.size () << " " << nonzero;
+    for (size_t i = 0; i < v.size (); i++)
+        if (v[i]) out << " " << i << " " << v[i];
+    out << "\n";
+}
+
+template < class T > void loadSparse (std::istream & in, std::vector < T > & v)
+{
+    size_t size = 0, nonzero = 0;
+    in >> size >> nonzero;
+    v.assign (size, 0);
+
+    for (size_t n = 0; n < nonzero and in.good (); n++) {
+        size_t i;
+        T x;
+        in >> i >> x;
+        if (i < size) v[i] = x;
+    }
+}
+
+/* Opens a checkpoint written by tool, false if it does not exist or is not valid */
+inline bool openCheckpoint (std::ifstream & in, const std::string & filename, const std::string & tool)
+{
+    in.open (filename.c_str ());
+    if (not in.is_open ()) return false;
+
+    std::string magic, who;
+    int version = 0;
+    in >> magic >> version >> who;
+    return magic == "blktrace-utils-checkpoint" and version == CHECKPOINT_VERSION and who == tool;
+}
+
+inline void createCheckpoint (std::ofstream & out, const std::string & filename, const std::string & tool)
+{
+    out.open ((filename + ".tmp").c_str ());
+    out << "blktrace-utils-checkpoint " << CHECKPOINT_VERSION << " " << tool << "\n";
+}
+
+inline bool commitCheckpoint (std::ofstream & out, const std::string & filename)
+{
+    out.close ();
+    if (out.fail ()) return false;
+    return rename ((filename + ".tmp").c_str (), filename.c_str ()) == 0;
+}
+
+#endif
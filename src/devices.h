@@ -0,0 +1,30 @@
+/**
+   devices - Names of the block devices found in the traces
+   Copyright (C) 2014 Ramon Nou at Barcelona Supercomputing Center
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   */
+
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <string>
+
+/* Device numbers use the kernel encoding, 12 bits major and 20 bits minor */
+inline std::string devName (unsigned int device)
+{
+    return std::to_string (device >> 20) + "," + std::to_string (device & 0xfffff);
+}
+
+#endif
@@ -0,0 +1,272 @@
+/**
+   tracecache - Columnar cache of a blktrace binary file
+   Copyright (C) 2014 Ramon Nou at Barcelona Supercomputing Center
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   */
+
+/*
+   The cache holds the records of a trace as columns (structure of arrays),
+   so a tool that only needs a few fields reads them at memory speed from a
+   mmapped file, instead of decoding the 48 byte records every run.
+
+   It is written once from the validated records of traceReader (byte order
+   fixed, cgroup ids taken out of the payload), with the process names of
+   the notify records side tabled at the end. Payloads are not kept, but
+   their length is, so records with a payload are still told apart. The
+   size and modification time of the input are kept in the header, and the
+   cache is not valid anymore when the input changes.
+
+   Layout: header, then each column for capacity records (64 byte aligned),
+   then the names table (count, and pid, length, bytes of each name).
+ */
+
+#ifndef TRACECACHE_H
+#define TRACECACHE_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tracereader.h"
+
+class traceCache
+{
+private:
+    static const __u32 VERSION = 1;
+
+    struct header {
+        char magic[8];
+        __u32 version;
+        __u32 pad;
+        __u64 records;
+        __u64 capacity;
+        __u64 inputSize;
+        __s64 inputTime;
+    };
+
+    void * mapped;
+    size_t mapSize;
+
+    static size_t align (size_t offset) {
+        return (offset + 63) & ~ (size_t) 63;
+    }
+
+    /* Offsets of the columns and of the names table, for capacity records */
+    static void layout (__u64 capacity, size_t offsets[9]) {
+        const size_t widths[8] = { sizeof (__u32), sizeof (__u32), sizeof (__u32), sizeof (__u32),
+                                   sizeof (__u64), sizeof (__u64), sizeof (__u64), sizeof (__u16)
+                                 };
+        offsets[0] = align (sizeof (header));
+        for (int i = 0; i < 8; i++) offsets[i + 1] = align (offsets[i] + capacity * widths[i]);
+    }
+
+    static bool inputStat (const std::string & input, __u64 & size, __s64 & time) {
+        struct stat st;
+        if (stat (input.c_str (), &st) != 0) return false;
+        size = st.st_size;
+        time = st.st_mtime;
+        return true;
+    }
+
+public:
+    __u64 records;
+    const __u32 * action;
+    const __u32 * pid;
+    const __u32 * device;
+    const __u32 * bytes;
+    const __u64 * sector;
+    const __u64 * time;
+    const __u64 * cgroup;
+    const __u16 * pdu_len;
+    std::vector < std::pair < __u32, std::string > > names;  /* In trace order */
+
+    traceCache () : mapped (MAP_FAILED), mapSize (0), records (0) {}
+
+    ~traceCache () {
+        close ();
+    }
+
+    /* Writes the cache of input, false if the input or the cache can not be used */
+    static bool build (const std::string & input, const std::string & filename) {
+        __u64 inputSize;
+        __s64 inputTime;
+        if (not inputStat (input, inputSize, inputTime)) return false;
+
+        traceReader reader;
+        if (not reader.open (input)) return false;
+
+        /* Records take at least 48 bytes, records appended meanwhile are left for a rebuild */
+        __u64 capacity = inputSize / sizeof (blk_io_trace);
+        size_t offsets[9];
+        layout (capacity, offsets);
+
+        std::string tmp = filename + ".tmp";
+        int fd = ::open (tmp.c_str (), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        if (ftruncate (fd, offsets[8]) != 0) {
+            ::close (fd);
+            return false;
+        }
+        char * base = (char *) mmap (NULL, offsets[8], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            ::close (fd);
+            return false;
+        }
+
+        __u32 * cAction = (__u32 *) (base + offsets[0]);
+        __u32 * cPid = (__u32 *) (base + offsets[1]);
+        __u32 * cDevice = (__u32 *) (base + offsets[2]);
+        __u32 * cBytes = (__u32 *) (base + offsets[3]);
+        __u64 * cSector = (__u64 *) (base + offsets[4]);
+        __u64 * cTime = (__u64 *) (base + offsets[5]);
+        __u64 * cCgroup = (__u64 *) (base + offsets[6]);
+        __u16 * cPduLen = (__u16 *) (base + offsets[7]);
+
+        std::vector < std::pair < __u32, std::string > > found;
+        blk_io_trace trace;
+        std::string pdu;
+        unsigned long long cg;
+        __u64 n = 0;
+
+        while (n < capacity and reader.next (trace, pdu, cg)) {
+            cAction[n] = trace.action;
+            cPid[n] = trace.pid;
+            cDevice[n] = trace.device;
+            cBytes[n] = trace.bytes;
+            cSector[n] = trace.sector;
+            cTime[n] = trace.time;
+            cCgroup[n] = cg;
+            cPduLen[n] = trace.pdu_len;
+            if (trace.action == BLK_TN_PROCESS)
+                found.push_back (std::make_pair (trace.pid, pdu.substr (0, strnlen (pdu.data (), pdu.size ()))));
+            n++;
+        }
+        reader.close ();
+        reader.report (input);
+
+        header h;
+        memset (&h, 0, sizeof (h));
+        memcpy (h.magic, "blkcache", sizeof (h.magic));
+        h.version = VERSION;
+        h.records = n;
+        h.capacity = capacity;
+        h.inputSize = inputSize;
+        h.inputTime = inputTime;
+        memcpy (base, &h, sizeof (h));
+        munmap (base, offsets[8]);
+
+        std::string table;
+        __u64 count = found.size ();
+        table.append ((const char *) &count, sizeof (count));
+        for (auto & N : found) {
+            __u32 len = N.second.size ();
+            table.append ((const char *) &N.first, sizeof (N.first));
+            table.append ((const char *) &len, sizeof (len));
+            table.append (N.second);
+        }
+
+        bool ok = pwrite (fd, table.data (), table.size (), offsets[8]) == (ssize_t) table.size ();
+        ok = ::close (fd) == 0 and ok;
+        return ok and rename (tmp.c_str (), filename.c_str ()) == 0;
+    }
+
+    /* Maps the cache of input, false if it does not exist or the input has changed */
+    bool open (const std::string & filename, const std::string & input) {
+        __u64 inputSize;
+        __s64 inputTime;
+        if (not inputStat (input, inputSize, inputTime)) return false;
+
+        int fd = ::open (filename.c_str (), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat (fd, &st) != 0 or (size_t) st.st_size < sizeof (header)) {
+            ::close (fd);
+            return false;
+        }
+        mapSize = st.st_size;
+        mapped = mmap (NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close (fd);
+        if (mapped == MAP_FAILED) return false;
+
+        const char * base = (const char *) mapped;
+        header h;
+        memcpy (&h, base, sizeof (h));
+
+        size_t offsets[9];
+        layout (h.capacity, offsets);
+
+        if (memcmp (h.magic, "blkcache", sizeof (h.magic)) != 0 or h.version != VERSION or
+                h.inputSize != inputSize or h.inputTime != inputTime or h.records > h.capacity or
+                offsets[8] + sizeof (__u64) > mapSize) {
+            close ();
+            return false;
+        }
+
+        records = h.records;
+        action = (const __u32 *) (base + offsets[0]);
+        pid = (const __u32 *) (base + offsets[1]);
+        device = (const __u32 *) (base + offsets[2]);
+        bytes = (const __u32 *) (base + offsets[3]);
+        sector = (const __u64 *) (base + offsets[4]);
+        time = (const __u64 *) (base + offsets[5]);
+        cgroup = (const __u64 *) (base + offsets[6]);
+        pdu_len = (const __u16 *) (base + offsets[7]);
+
+        /* Sequential scans of the columns */
+        madvise (mapped, mapSize, MADV_SEQUENTIAL);
+
+        size_t p = offsets[8];
+        __u64 count;
+        memcpy (&count, base + p, sizeof (count));
+        p += sizeof (count);
+        names.clear ();
+        for (__u64 i = 0; i < count and p + 2 * sizeof (__u32) <= mapSize; i++) {
+            __u32 id, len;
+            memcpy (&id, base + p, sizeof (id));
+            memcpy (&len, base + p + sizeof (id), sizeof (len));
+            p += 2 * sizeof (__u32);
+            if (p + len > mapSize) break;
+            names.push_back (std::make_pair (id, std::string (base + p, len)));
+            p += len;
+        }
+        return true;
+    }
+
+    /* Record i, with the fields kept in the cache */
+    void row (__u64 i, blk_io_trace & trace) const {
+        memset (&trace, 0, sizeof (trace));
+        trace.action = action[i];
+        trace.pid = pid[i];
+        trace.device = device[i];
+        trace.bytes = bytes[i];
+        trace.sector = sector[i];
+        trace.time = time[i];
+        trace.pdu_len = pdu_len[i];
+    }
+
+    void close () {
+        if (mapped != MAP_FAILED) munmap (mapped, mapSize);
+        mapped = MAP_FAILED;
+        records = 0;
+    }
+};
+
+#endif
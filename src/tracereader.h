@@ -0,0 +1,252 @@
+/**
+   tracereader - Validated reader of blktrace binary records
+   Copyright (C) 2014 Ramon Nou at Barcelona Supercomputing Center
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   */
+
+/*
+   traceReader reads the records of a blktrace binary file through a large
+   buffer, checking the magic and version of every record.
+
+   The byte order is selected once per file, from the first valid record, so
+   traces captured on an opposite endian box are byte swapped.
+   Records with a wrong magic, an insane pdu_len or cpu are skipped by scanning
+   for the next valid magic. Skipped bytes are counted and can be reported at
+   the end. Newer kernels put the cgroup id in front of the payload, next ()
+   takes it out. An incomplete record at the end of the file is not consumed,
+   so offset() can be used to resume reading a growing file later on.
+ */
+
+#ifndef TRACEREADER_H
+#define TRACEREADER_H
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <linux/blktrace_api.h>
+
+class traceReader
+{
+private:
+    /* Process names and remaps are 16 bytes, anything much larger is garbage */
+    static const unsigned int MAX_PDU_LEN = 4096;
+    /* Largest NR_CPUS of the kernel configs, a cpu beyond it is garbage */
+    static const unsigned int MAX_CPU = 8192;
+    static const size_t BUFFER_SIZE = 1 << 20;
+    /* __BLK_TA_CGROUP (and __BLK_TN_CGROUP), missing in older headers */
+    static const __u32 TA_CGROUP = 1 << 8;
+
+    std::ifstream ifs;
+    std::vector < char > buffer;
+    size_t begin;   /* First unread byte in buffer */
+    size_t end;     /* Last valid byte in buffer */
+    unsigned long long base; /* File offset of buffer[0] */
+    bool swap;
+    bool endianKnown;
+
+    /* Makes at least n bytes available from begin, false if the file ends before */
+    bool fill (size_t n) {
+        if (end - begin >= n) return true;
+
+        memmove (buffer.data (), buffer.data () + begin, end - begin);
+        base += begin;
+        end -= begin;
+        begin = 0;
+
+        while (end < n and ifs.good ()) {
+            ifs.read (buffer.data () + end, buffer.size () - end);
+            end += ifs.gcount ();
+        }
+
+        return end >= n;
+    }
+
+    static bool valid (const char * p, bool swapped) {
+        __u32 magic;
+        __u32 cpu;
+        __u16 pdu_len;
+
+        memcpy (&magic, p, sizeof (magic));
+        memcpy (&cpu, p + offsetof (blk_io_trace, cpu), sizeof (cpu));
+        memcpy (&pdu_len, p + offsetof (blk_io_trace, pdu_len), sizeof (pdu_len));
+
+        if (swapped) {
+            magic = __builtin_bswap32 (magic);
+            cpu = __builtin_bswap32 (cpu);
+            pdu_len = __builtin_bswap16 (pdu_len);
+        }
+
+        return (magic & 0xffffff00) == BLK_IO_TRACE_MAGIC and
+               (magic & 0xff) == BLK_IO_TRACE_VERSION and pdu_len <= MAX_PDU_LEN and cpu < MAX_CPU;
+    }
+
+    bool valid (const char * p) {
+        if (endianKnown) return valid (p, swap);
+
+        if (valid (p, false)) swap = false;
+        else if (valid (p, true)) swap = true;
+        else return false;
+
+        endianKnown = true;
+        return true;
+    }
+
+    /*
+       Advances begin to the next valid record, counting the skipped bytes.
+       The 'a' of the magic is at byte 2 (little endian) or 1 (big endian),
+       so we look for it with memchr and check the candidates around it.
+     */
+    void resync () {
+        resyncs++;
+        begin++;
+        skipped++;
+
+        while (fill (sizeof (blk_io_trace))) {
+            const char * first = buffer.data () + begin;
+            const char * last = buffer.data () + end - sizeof (blk_io_trace);
+            const char * p = first;
+
+            while (p <= last) {
+                const char * a = (const char *) memchr (p, (BLK_IO_TRACE_MAGIC >> 16) & 0xff, last + 3 - p);
+                if (a == NULL) {
+                    p = last + 1;
+                    break;
+                }
+
+                if (a - 1 >= p and a - 1 <= last and valid (a - 1)) {
+                    p = a - 1;
+                    break;
+                }
+                if (a - 2 >= p and a - 2 <= last and valid (a - 2)) {
+                    p = a - 2;
+                    break;
+                }
+                p = a + 1;
+            }
+
+            skipped += p - first;
+            begin += p - first;
+
+            if (p <= last) return;
+        }
+        /* Less than a record left, next () leaves it as incomplete */
+    }
+
+public:
+    unsigned long long skipped;
+    unsigned long long resyncs;
+    unsigned long long incomplete; /* Bytes of an incomplete record at the end */
+
+    traceReader () : buffer (BUFFER_SIZE), begin (0), end (0), base (0),
+        swap (false), endianKnown (false), skipped (0), resyncs (0), incomplete (0) {}
+
+    /* Opens the file, starting at offset, which must be the beginning of a record */
+    bool open (const std::string & filename, unsigned long long offset = 0) {
+        ifs.open (filename.c_str (), std::ifstream::binary);
+        if (not (ifs.is_open () and ifs.good ())) return false;
+
+        if (offset) {
+            ifs.seekg (0, std::ios::end);
+            if ((unsigned long long) ifs.tellg () < offset) return false;
+            ifs.seekg (offset);
+            base = offset;
+        }
+        return true;
+    }
+
+    void close () {
+        ifs.close ();
+    }
+
+    /* True if the trace was captured on an opposite endian box */
+    bool swapped () const {
+        return swap;
+    }
+
+    /* File offset of the next record */
+    unsigned long long offset () const {
+        return base + begin;
+    }
+
+    /* Reads the next valid record and its payload, false at the end of the file */
+    bool next (blk_io_trace & trace, std::string & pdu) {
+        unsigned long long cgroup;
+        return next (trace, pdu, cgroup);
+    }
+
+    /*
+       Same, also returning the cgroup id of the record (0 if it has none).
+       The id is removed from the payload and its flag from the action, so
+       records from a cgroup look like any other record.
+     */
+    bool next (blk_io_trace & trace, std::string & pdu, unsigned long long & cgroup) {
+        cgroup = 0;
+        while (fill (sizeof (blk_io_trace))) {
+            const char * p = buffer.data () + begin;
+
+            if (not valid (p)) {
+                resync ();
+                continue;
+            }
+
+            memcpy (&trace, p, sizeof (blk_io_trace));
+
+            if (swap) {
+                trace.magic = __builtin_bswap32 (trace.magic);
+                trace.sequence = __builtin_bswap32 (trace.sequence);
+                trace.time = __builtin_bswap64 (trace.time);
+                trace.sector = __builtin_bswap64 (trace.sector);
+                trace.bytes = __builtin_bswap32 (trace.bytes);
+                trace.action = __builtin_bswap32 (trace.action);
+                trace.pid = __builtin_bswap32 (trace.pid);
+                trace.device = __builtin_bswap32 (trace.device);
+                trace.cpu = __builtin_bswap32 (trace.cpu);
+                trace.error = __builtin_bswap16 (trace.error);
+                trace.pdu_len = __builtin_bswap16 (trace.pdu_len);
+            }
+
+            if (not fill (sizeof (blk_io_trace) + trace.pdu_len)) break;
+
+            pdu.assign (buffer.data () + begin + sizeof (blk_io_trace), trace.pdu_len);
+            begin += sizeof (blk_io_trace) + trace.pdu_len;
+
+            if ((trace.action & TA_CGROUP) and pdu.size () >= sizeof (cgroup)) {
+                memcpy (&cgroup, pdu.data (), sizeof (cgroup));
+                if (swap) cgroup = __builtin_bswap64 (cgroup);
+                pdu.erase (0, sizeof (cgroup));
+                trace.pdu_len -= sizeof (cgroup);
+                trace.action &= ~TA_CGROUP;
+            }
+            return true;
+        }
+
+        /* Incomplete record at the end of the file, left for a later run */
+        incomplete = end - begin;
+        return false;
+    }
+
+    void report (const std::string & filename) const {
+        if (skipped)
+            std::cerr << filename << ": skipped " << skipped << " bytes of invalid records (" <<
+                      resyncs << " resyncs)" << std::endl;
+        if (incomplete)
+            std::cerr << filename << ": " << incomplete << " bytes of an incomplete record at the end" << std::endl;
+    }
+};
+
+#endif